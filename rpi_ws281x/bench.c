@@ -0,0 +1,412 @@
+/*
+ * bench.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "ws2811.h"
+#include "encode.h"
+#include "monotonic.h"
+
+
+/*
+ * Encoder benchmark.  Times ws2811_render() against the memory backend set up by
+ * ws2811_mem_instant_init(), so every frame is encoded, copied out of the staging buffer and
+ * captured as on the hardware, but nothing waits for the wire.  Every frame changes every LED,
+ * which defeats the dirty tracking and frame skipping.  The render_ columns are that cost, the
+ * wire_fps column what the strip itself allows.
+ */
+
+// What the render_ columns measure, printed with the results
+#define BENCH_MEASURED                           "ws2811_render(), memory output without wire time"
+
+#define BENCH_MIN_FRAMES                         8
+#define BENCH_MIN_NS                             200000000ULL   // 0.2s per configuration
+
+typedef struct
+{
+    const char *name;
+    int gpionum;
+} bench_mode_t;
+
+static const bench_mode_t modes[] =
+{
+    { "pwm", 18 },
+    { "pcm", 21 },
+    { "spi", 10 },
+};
+
+static const int counts[] = { 8, 64, 512, 4096, 32768, 65536 };
+
+typedef struct
+{
+    const char *mode;
+    int leds;
+    int colours;
+    int invert;
+    uint64_t frames;
+    double ns_per_frame;
+    double ns_per_led;
+    double fps;
+    double wire_fps;                             //< Frames per second the wire allows
+    size_t frame_bytes;
+    double cycles_per_byte;                      //< Negative if no cycle counter is available
+    double encode_ns;                            //< Per frame
+    double copy_ns;                              //< Per frame
+} bench_result_t;
+
+/**
+ * Open a user space CPU cycle counter for this thread.
+ *
+ * @returns  File descriptor, or -1 if the kernel or the CPU has none.
+ */
+static int cycles_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cycles_read(int fd)
+{
+    uint64_t count = 0;
+
+    if ((fd < 0) || (read(fd, &count, sizeof(count)) != sizeof(count)))
+    {
+        return 0;
+    }
+
+    return count;
+}
+
+/**
+ * Benchmark one configuration.
+ *
+ * @param    mode     Output layout.
+ * @param    leds     Number of LEDs.
+ * @param    colours  3 or 4.
+ * @param    invert   Invert the output.
+ * @param    workers  Encoder threads.
+ * @param    result   Filled in.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static int bench_run(const bench_mode_t *mode, int leds, int colours, int invert, int workers,
+                     bench_result_t *result)
+{
+    ws2811_t ws2811 =
+    {
+        .freq = WS2811_TARGET_FREQ,
+        .dmanum = 10,
+        .channel =
+        {
+            [0] =
+            {
+                .gpionum = mode->gpionum,
+                .count = leds,
+                .invert = invert,
+                .brightness = 255,
+                .strip_type = (colours == 4) ? SK6812_STRIP_GRBW : WS2811_STRIP_GRB,
+            },
+        },
+    };
+    ws2811_led_t *frames[2], *own;
+    ws2811_stats_t stats;
+    uint64_t start, elapsed, cycles = 0, n = 0;
+    int fd, i;
+
+    if (ws2811_mem_instant_init(&ws2811) != WS2811_SUCCESS)
+    {
+        return -1;
+    }
+    if (ws2811_set_encode_workers(&ws2811, workers) != WS2811_SUCCESS)
+    {
+        ws2811_fini(&ws2811);
+        return -1;
+    }
+
+    // Two frames that differ in every LED, swapped in instead of written per frame
+    frames[0] = malloc(sizeof(ws2811_led_t) * leds);
+    frames[1] = malloc(sizeof(ws2811_led_t) * leds);
+    if (!frames[0] || !frames[1])
+    {
+        free(frames[0]);
+        free(frames[1]);
+        ws2811_fini(&ws2811);
+        return -1;
+    }
+    for (i = 0; i < leds; i++)
+    {
+        frames[0][i] = (i * 2654435761U) & 0xffffffff;
+        frames[1][i] = ~frames[0][i];
+    }
+    own = ws2811.channel[0].leds;
+
+    // Warm up caches and the frame buffers
+    for (i = 0; i < 2; i++)
+    {
+        ws2811.channel[0].leds = frames[i & 1];
+        ws2811_render(&ws2811);
+    }
+    ws2811_reset_stats(&ws2811);
+
+    fd = cycles_open();
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    start = monotonic_ns();
+    do
+    {
+        ws2811.channel[0].leds = frames[n & 1];
+        if (ws2811_render(&ws2811) != WS2811_SUCCESS)
+        {
+            break;
+        }
+        n++;
+        elapsed = monotonic_ns() - start;
+    } while ((n < BENCH_MIN_FRAMES) || (elapsed < BENCH_MIN_NS));
+
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        cycles = cycles_read(fd);
+        close(fd);
+    }
+
+    ws2811_get_stats(&ws2811, &stats);
+    ws2811_get_mem_frame(&ws2811, &result->frame_bytes);
+
+    // Every frame must have been encoded and sent, or the timing is not of a whole render
+    if (!n || (stats.frames != n) || (stats.starts != n))
+    {
+        fprintf(stderr, "%s %d LEDs: %llu of %llu frames sent\n", mode->name, leds,
+                (unsigned long long)stats.starts, (unsigned long long)n);
+        ws2811.channel[0].leds = own;
+        ws2811_fini(&ws2811);
+        free(frames[0]);
+        free(frames[1]);
+        return -1;
+    }
+
+    result->mode = mode->name;
+    result->leds = leds;
+    result->colours = colours;
+    result->invert = invert;
+    result->frames = n;
+    result->ns_per_frame = (double)elapsed / n;
+    result->ns_per_led = result->ns_per_frame / leds;
+    result->fps = 1e9 / result->ns_per_frame;
+    result->wire_fps = 1e6 / ws2811_get_frame_time(&ws2811);
+    result->cycles_per_byte = cycles ? (double)cycles / ((double)n * result->frame_bytes) : -1;
+    result->encode_ns = (double)stats.encode_ns / n;
+    result->copy_ns = (double)stats.copy_ns / n;
+
+    ws2811.channel[0].leds = own;
+    ws2811_fini(&ws2811);
+    free(frames[0]);
+    free(frames[1]);
+
+    return 0;
+}
+
+static void print_csv(const bench_result_t *r, int header)
+{
+    if (header)
+    {
+        printf("# %s\n", BENCH_MEASURED);
+        printf("mode,leds,colours,invert,frames,render_ns_per_frame,render_ns_per_led,"
+               "render_fps,wire_fps,frame_bytes,cycles_per_byte,encode_ns_per_frame,"
+               "copy_ns_per_frame\n");
+        return;
+    }
+
+    printf("%s,%d,%d,%d,%llu,%.1f,%.3f,%.1f,%.1f,%zu,", r->mode, r->leds, r->colours,
+           r->invert, (unsigned long long)r->frames, r->ns_per_frame, r->ns_per_led, r->fps,
+           r->wire_fps, r->frame_bytes);
+    if (r->cycles_per_byte >= 0)
+    {
+        printf("%.3f", r->cycles_per_byte);
+    }
+    printf(",%.1f,%.1f\n", r->encode_ns, r->copy_ns);
+}
+
+static void print_json(const bench_result_t *r, int first)
+{
+    printf("%s    {\"mode\": \"%s\", \"leds\": %d, \"colours\": %d, \"invert\": %d, "
+           "\"frames\": %llu, \"render_ns_per_frame\": %.1f, \"render_ns_per_led\": %.3f, "
+           "\"render_fps\": %.1f, \"wire_fps\": %.1f, \"frame_bytes\": %zu, "
+           "\"cycles_per_byte\": ",
+           first ? "" : ",\n", r->mode, r->leds, r->colours, r->invert,
+           (unsigned long long)r->frames, r->ns_per_frame, r->ns_per_led, r->fps, r->wire_fps,
+           r->frame_bytes);
+    if (r->cycles_per_byte >= 0)
+    {
+        printf("%.3f", r->cycles_per_byte);
+    }
+    else
+    {
+        printf("null");
+    }
+    printf(", \"encode_ns_per_frame\": %.1f, \"copy_ns_per_frame\": %.1f}", r->encode_ns,
+           r->copy_ns);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-f csv|json] [-w workers] [-m pwm|pcm|spi] [-n leds]\n"
+            "-f  - output format, default csv\n"
+            "-w  - encoder threads, default 0\n"
+            "-m  - only this layout\n"
+            "-n  - only this LED count, any count from 1 up\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *only_mode = NULL;
+    const int *run_counts = counts;
+    size_t run_count_len = sizeof(counts) / sizeof(counts[0]);
+    int json = 0, workers = 0, only_count = 0, first = 1;
+    size_t m, c;
+    int colours, invert, opt;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "f:w:m:n:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            json = !strcmp(optarg, "json");
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'm':
+            only_mode = optarg;
+            for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+            {
+                if (!strcmp(only_mode, modes[m].name))
+                {
+                    break;
+                }
+            }
+            if (m == sizeof(modes) / sizeof(modes[0]))
+            {
+                fprintf(stderr, "Unknown layout %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'n':
+            only_count = strtol(optarg, &end, 10);
+            if (*end || (only_count <= 0))
+            {
+                fprintf(stderr, "Bad LED count %s\n", optarg);
+                return -1;
+            }
+            // Any count, not just one of the defaults
+            run_counts = &only_count;
+            run_count_len = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (json)
+    {
+        printf("{\n  \"measured\": \"%s\",\n  \"kernel\": \"%s\",\n  \"workers\": %d,\n"
+               "  \"results\": [\n", BENCH_MEASURED, encode_get_kernel()->name, workers);
+    }
+    else
+    {
+        print_csv(NULL, 1);
+    }
+
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        if (only_mode && strcmp(only_mode, modes[m].name))
+        {
+            continue;
+        }
+
+        for (c = 0; c < run_count_len; c++)
+        {
+            for (colours = 3; colours <= 4; colours++)
+            {
+                for (invert = 0; invert < 2; invert++)
+                {
+                    bench_result_t result;
+
+                    if (bench_run(&modes[m], run_counts[c], colours, invert, workers, &result))
+                    {
+                        fprintf(stderr, "%s %d LEDs failed\n", modes[m].name, run_counts[c]);
+                        return -1;
+                    }
+
+                    if (json)
+                    {
+                        print_json(&result, first);
+                    }
+                    else
+                    {
+                        print_csv(&result, 0);
+                    }
+                    fflush(stdout);
+                    first = 0;
+                }
+            }
+        }
+    }
+
+    if (json)
+    {
+        printf("\n  ]\n}\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * canvas.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ws2811.h"
+#include "canvas.h"
+
+
+/**
+ * Check the segment map, allocate the canvas and work out the order the outputs are started
+ * in.  The instances must have been initialized already, the PWM and PCM ones each on a DMA
+ * channel of its own.
+ *
+ * @param    canvas  Canvas with count and segments filled in.
+ *
+ * @returns  0 on success, < 0 otherwise.
+ */
+ws2811_return_t canvas_init(canvas_t *canvas)
+{
+    int i, j, pass;
+
+    canvas->leds = NULL;
+    canvas->output_count = 0;
+
+    if ((canvas->count <= 0) || (canvas->segment_count <= 0) ||
+        (canvas->segment_count > CANVAS_SEGMENTS_MAX))
+    {
+        fprintf(stderr, "Canvas needs LEDs and 1 to %d segments\n", CANVAS_SEGMENTS_MAX);
+        return WS2811_ERROR_GENERIC;
+    }
+
+    for (i = 0; i < canvas->segment_count; i++)
+    {
+        canvas_segment_t *segment = &canvas->segment[i];
+
+        if (!segment->ws2811 || !segment->ws2811->device ||
+            (segment->channel < 0) || (segment->channel >= RPI_PWM_CHANNELS))
+        {
+            fprintf(stderr, "Canvas segment %d has no output\n", i);
+            return WS2811_ERROR_GENERIC;
+        }
+        if ((segment->start < 0) || (segment->count < 0) ||
+            (segment->start + segment->count > canvas->count) ||
+            (segment->count > segment->ws2811->channel[segment->channel].count))
+        {
+            fprintf(stderr, "Canvas segment %d does not fit\n", i);
+            return WS2811_ERROR_GENERIC;
+        }
+        for (j = 0; j < i; j++)
+        {
+            if ((canvas->segment[j].ws2811 == segment->ws2811) &&
+                (canvas->segment[j].channel == segment->channel))
+            {
+                fprintf(stderr, "Canvas segments %d and %d share a channel\n", j, i);
+                return WS2811_ERROR_GENERIC;
+            }
+        }
+    }
+
+    // DMA driven outputs first, they run in the background while the SPI transfer blocks
+    // until it is sent
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (i = 0; i < canvas->segment_count; i++)
+        {
+            ws2811_t *ws2811 = canvas->segment[i].ws2811;
+
+            if ((ws2811_get_driver(ws2811) == WS2811_DRIVER_SPI) != pass)
+            {
+                continue;
+            }
+            for (j = 0; j < canvas->output_count; j++)
+            {
+                if (canvas->outputs[j] == ws2811)
+                {
+                    break;
+                }
+            }
+            if (j == canvas->output_count)
+            {
+                canvas->outputs[canvas->output_count++] = ws2811;
+            }
+        }
+    }
+
+    // Two outputs driving one DMA channel overwrite each other's control blocks
+    for (i = 0; i < canvas->output_count; i++)
+    {
+        ws2811_t *ws2811 = canvas->outputs[i];
+
+        if (ws2811_get_driver(ws2811) == WS2811_DRIVER_SPI)
+        {
+            continue;
+        }
+        for (j = 0; j < i; j++)
+        {
+            if ((ws2811_get_driver(canvas->outputs[j]) != WS2811_DRIVER_SPI) &&
+                (canvas->outputs[j]->dmanum == ws2811->dmanum))
+            {
+                fprintf(stderr, "Canvas outputs %d and %d share DMA channel %d\n", j, i,
+                        ws2811->dmanum);
+                canvas->output_count = 0;
+                return WS2811_ERROR_GENERIC;
+            }
+        }
+    }
+
+    canvas->leds = calloc(canvas->count, sizeof(ws2811_led_t));
+    if (!canvas->leds)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Free the canvas.  The instances belong to the caller and are left running.
+ *
+ * @param    canvas  Canvas.
+ *
+ * @returns  None
+ */
+void canvas_fini(canvas_t *canvas)
+{
+    free(canvas->leds);
+    canvas->leds = NULL;
+    canvas->output_count = 0;
+}
+
+/**
+ * Copy every segment of the canvas into its channel and start all outputs.  Each output only
+ * waits for its own previous frame, and encoding the next output overlaps with the transfers
+ * already running.
+ *
+ * @param    canvas  Canvas.
+ *
+ * @returns  0 on success, < 0 on the first output that failed.
+ */
+ws2811_return_t canvas_render(canvas_t *canvas)
+{
+    ws2811_return_t ret;
+    int i, j;
+
+    for (i = 0; i < canvas->segment_count; i++)
+    {
+        canvas_segment_t *segment = &canvas->segment[i];
+        const ws2811_led_t *src = &canvas->leds[segment->start];
+        ws2811_channel_t *channel = &segment->ws2811->channel[segment->channel];
+        ws2811_led_t *dst = channel->leds;
+
+        // Segments are copied in strip order
+        channel->offset = 0;
+        channel->map = NULL;
+
+        if (!segment->reverse)
+        {
+            memcpy(dst, src, sizeof(ws2811_led_t) * segment->count);
+            continue;
+        }
+
+        for (j = 0; j < segment->count; j++)
+        {
+            dst[segment->count - 1 - j] = src[j];
+        }
+    }
+
+    for (i = 0; i < canvas->output_count; i++)
+    {
+        if ((ret = ws2811_render(canvas->outputs[i])) != WS2811_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Wait for every output to finish the frame it is sending.
+ *
+ * @param    canvas  Canvas.
+ *
+ * @returns  0 on success, < 0 on the first output that failed.
+ */
+ws2811_return_t canvas_wait(canvas_t *canvas)
+{
+    ws2811_return_t ret;
+    int i;
+
+    for (i = 0; i < canvas->output_count; i++)
+    {
+        if ((ret = ws2811_wait(canvas->outputs[i])) != WS2811_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Get the time a frame of the canvas occupies the wire, that of the slowest output.
+ *
+ * @param    canvas  Canvas.
+ *
+ * @returns  Frame time in microseconds.
+ */
+uint32_t canvas_get_frame_time(canvas_t *canvas)
+{
+    uint32_t frame_time = 0;
+    int i;
+
+    for (i = 0; i < canvas->output_count; i++)
+    {
+        uint32_t output_time = ws2811_get_frame_time(canvas->outputs[i]);
+
+        if (output_time > frame_time)
+        {
+            frame_time = output_time;
+        }
+    }
+
+    return frame_time;
+}
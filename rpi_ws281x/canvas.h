@@ -0,0 +1,77 @@
+/*
+ * canvas.h
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef __CANVAS_H__
+#define __CANVAS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ws2811.h"
+
+
+#define CANVAS_SEGMENTS_MAX                      4
+
+/*
+ * One logical LED array split across several outputs, e.g. both PWM channels of one instance
+ * plus a PCM and an SPI instance.  Every output sends its segment at the same time, so the
+ * frame takes as long as the longest segment instead of the whole canvas.
+ */
+typedef struct
+{
+    ws2811_t *ws2811;                            //< Initialized instance sending the segment
+    int channel;                                 //< Channel of the instance
+    int start;                                   //< First canvas LED of the segment
+    int count;                                   //< Number of LEDs, at most the channel count
+    int reverse;                                 //< Reversed, LED start of the canvas goes to channel LED count - 1
+} canvas_segment_t;
+
+typedef struct
+{
+    int count;                                   //< Number of canvas LEDs
+    ws2811_led_t *leds;                          //< Canvas, allocated by canvas_init()
+    int segment_count;                           //< Segments in use
+    canvas_segment_t segment[CANVAS_SEGMENTS_MAX];
+    ws2811_t *outputs[CANVAS_SEGMENTS_MAX];      //< Distinct instances in the order they are started
+    int output_count;
+} canvas_t;
+
+ws2811_return_t canvas_init(canvas_t *canvas);   //< Check the segment map and allocate the canvas
+void canvas_fini(canvas_t *canvas);              //< Free the canvas, the instances are left alone
+ws2811_return_t canvas_render(canvas_t *canvas); //< Split the canvas up and start every output
+ws2811_return_t canvas_wait(canvas_t *canvas);   //< Wait for every output to finish
+uint32_t canvas_get_frame_time(canvas_t *canvas);  //< Wire time of one frame in µs
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CANVAS_H__ */
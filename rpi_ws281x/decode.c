@@ -0,0 +1,173 @@
+/*
+ * decode.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+
+#include "ws2811.h"
+#include "encode.h"
+#include "decode.h"
+
+
+// Every bit of a symbol word is 1 x 0, the data bit in the middle
+#define SYMBOL_OUTER                             0x924924
+#define SYMBOL_INNER                             0x249249
+#define SYMBOL_DATA                              0x492492
+#define SYMBOL_MASK                              0xffffff
+
+/**
+ * Decode one symbol word.
+ *
+ * @param    symbol  24 symbol bits, the first one sent in bit 23.
+ * @param    invert  Software inverted symbols.
+ *
+ * @returns  Colour byte, -1 if any of the 8 symbols is not a valid 0 or 1.
+ */
+int decode_symbol(uint32_t symbol, int invert)
+{
+    int byte = 0;
+    int i;
+
+    if (invert)
+    {
+        symbol ^= SYMBOL_MASK;
+    }
+
+    if (((symbol & (SYMBOL_OUTER | SYMBOL_INNER)) != SYMBOL_OUTER) || (symbol & ~SYMBOL_MASK))
+    {
+        return -1;
+    }
+
+    for (i = 7; i >= 0; i--)
+    {
+        byte |= ((symbol >> (i * 3 + 1)) & 1) << i;
+    }
+
+    return byte;
+}
+
+/**
+ * Fetch word n of a channel's stream.
+ */
+static inline uint32_t stream_word(const uint32_t *words, size_t n, int layout)
+{
+    switch (layout)
+    {
+    case ENCODE_LAYOUT_PWM:
+        return words[n * 2];
+    case ENCODE_LAYOUT_SPI:
+        return ntohl(words[n]);
+    default:
+        return words[n];
+    }
+}
+
+/**
+ * Decode the LEDs of one channel.  Decoding ends at the end of the buffer or at the reset,
+ * a symbol word with the line idle at either level, which is where a shortened frame ends.
+ * Anything else that is not a valid symbol is an error, so is a reset in the middle of an
+ * LED.
+ *
+ * @param    words   First word of the channel, pxl_raw + channel for PWM.
+ * @param    count   Words of the channel's stream in the buffer.
+ * @param    bitpos  Bit position the channel starts at in its first word, 31 if aligned.
+ * @param    format  Layout and strip type of the channel.
+ * @param    leds    Filled with the decoded LEDs.
+ * @param    max     Maximum number of LEDs to decode.
+ * @param    error   Filled in on a malformed symbol, may be NULL.
+ *
+ * @returns  Number of LEDs decoded, -1 on a malformed symbol.
+ */
+int decode_channel(const uint32_t *words, size_t count, int bitpos,
+                   const decode_format_t *format, ws2811_led_t *leds, int max,
+                   decode_error_t *error)
+{
+    const int bits = format->colours * ENCODE_SYMBOL_BITS;
+    uint32_t offset = 31 - bitpos;
+    int led, colour;
+
+    for (led = 0; led < max; led++)
+    {
+        ws2811_led_t value = 0;
+
+        for (colour = 0; colour < format->colours; colour++)
+        {
+            uint32_t bit = offset + led * bits + colour * ENCODE_SYMBOL_BITS;
+            size_t n = bit / 32;
+            int shift = bit % 32;
+            uint32_t symbol;
+            int byte;
+
+            if (n + (shift > 8) >= count)
+            {
+                if (!colour)
+                {
+                    return led;
+                }
+                symbol = 0;
+            }
+            else if (shift <= 8)
+            {
+                symbol = (stream_word(words, n, format->layout) >> (8 - shift)) & SYMBOL_MASK;
+            }
+            else
+            {
+                symbol = ((stream_word(words, n, format->layout) << (shift - 8)) |
+                          (stream_word(words, n + 1, format->layout) >> (40 - shift))) & SYMBOL_MASK;
+            }
+
+            byte = decode_symbol(symbol, format->invert);
+            if (byte < 0)
+            {
+                if (!colour && ((symbol == 0) || (symbol == SYMBOL_MASK)))
+                {
+                    return led;
+                }
+
+                if (error)
+                {
+                    error->led = led;
+                    error->colour = colour;
+                    error->bit = bit;
+                    error->symbol = symbol;
+                }
+
+                return -1;
+            }
+
+            value |= (ws2811_led_t)byte << format->shift[colour];
+        }
+
+        leds[led] = value;
+    }
+
+    return led;
+}
@@ -0,0 +1,68 @@
+/*
+ * decode.h
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ws2811.h"
+#include "encode.h"
+
+
+/*
+ * The inverse of the encoder: turns the symbols in an output buffer back into LED colours and
+ * checks every symbol on the way.  Colours come out after brightness and gamma correction,
+ * exactly as the strip would see them.
+ */
+typedef struct
+{
+    int layout;                                  //< One of ENCODE_LAYOUT_xxx
+    int invert;                                  //< Software inverted symbols
+    int colours;                                 //< Bytes per LED, 3 (RGB) or 4 (RGBW)
+    uint8_t shift[4];                            //< Bit position of each colour, as for the encoder
+} decode_format_t;
+
+typedef struct decode_error
+{
+    int led;                                     //< LED the bad symbol belongs to
+    int colour;                                  //< Byte of the LED in wire order
+    uint32_t bit;                                //< Offset of the symbol from the start of the channel
+    uint32_t symbol;                             //< The 24 symbol bits as found
+} decode_error_t;
+
+int decode_symbol(uint32_t symbol, int invert);                        //< Colour byte of a symbol word, -1 if malformed
+int decode_channel(const uint32_t *words, size_t count, int bitpos,
+                   const decode_format_t *format, ws2811_led_t *leds, int max,
+                   decode_error_t *error);                             //< LEDs decoded, -1 on a malformed symbol
+
+
+#endif /* __DECODE_H__ */
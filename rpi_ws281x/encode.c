@@ -0,0 +1,1091 @@
+/*
+ * encode.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ENCODE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ENCODE_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#include "ws2811.h"
+#include "encode.h"
+#include "decode.h"
+
+
+// Symbol definitions
+#define SYMBOL_HIGH                              0x6  // 1 1 0
+#define SYMBOL_LOW                               0x4  // 1 0 0
+
+// Symbol definitions for software inversion (PCM and SPI only)
+#define SYMBOL_HIGH_INV                          0x1  // 0 0 1
+#define SYMBOL_LOW_INV                           0x3  // 0 1 1
+
+// Every colour byte expands to 8 symbols of 3 bits, MSB first, i.e. one 24-bit symbol word.
+// The tables below are generated at compile time for all 256 byte values.
+#define SYMBOL_BIT(b, n, hi, lo)                 ((uint32_t)((((b) >> (n)) & 1) ? (hi) : (lo)) << ((n) * 3))
+#define SYMBOL_WORD(b, hi, lo)                   (SYMBOL_BIT(b, 7, hi, lo) | SYMBOL_BIT(b, 6, hi, lo) | \
+                                                  SYMBOL_BIT(b, 5, hi, lo) | SYMBOL_BIT(b, 4, hi, lo) | \
+                                                  SYMBOL_BIT(b, 3, hi, lo) | SYMBOL_BIT(b, 2, hi, lo) | \
+                                                  SYMBOL_BIT(b, 1, hi, lo) | SYMBOL_BIT(b, 0, hi, lo))
+#define SYMBOL_WORDS_4(b, hi, lo)                SYMBOL_WORD((b) + 0, hi, lo), SYMBOL_WORD((b) + 1, hi, lo), \
+                                                 SYMBOL_WORD((b) + 2, hi, lo), SYMBOL_WORD((b) + 3, hi, lo)
+#define SYMBOL_WORDS_16(b, hi, lo)               SYMBOL_WORDS_4((b) + 0, hi, lo), SYMBOL_WORDS_4((b) + 4, hi, lo), \
+                                                 SYMBOL_WORDS_4((b) + 8, hi, lo), SYMBOL_WORDS_4((b) + 12, hi, lo)
+#define SYMBOL_WORDS_64(b, hi, lo)               SYMBOL_WORDS_16((b) + 0, hi, lo), SYMBOL_WORDS_16((b) + 16, hi, lo), \
+                                                 SYMBOL_WORDS_16((b) + 32, hi, lo), SYMBOL_WORDS_16((b) + 48, hi, lo)
+#define SYMBOL_WORDS_256(hi, lo)                 SYMBOL_WORDS_64(0, hi, lo), SYMBOL_WORDS_64(64, hi, lo), \
+                                                 SYMBOL_WORDS_64(128, hi, lo), SYMBOL_WORDS_64(192, hi, lo)
+
+// The same symbol words computed arithmetically for the vector kernels: the data bit of
+// every symbol is the middle one, the outer two bits are constant.
+#define SYMBOL_BASE                              0x924924  // 1 x 0 for every bit
+#define SYMBOL_BASE_INV                          0x249249  // 0 x 1 for every bit, x inverted
+
+// Kernel selection benchmarks every verified kernel on this many RGB LEDs
+#define ENCODE_CALIBRATE_LEDS                    1024
+#define ENCODE_CALIBRATE_RUNS                    4
+
+// Largest channel of the randomised differential check
+#define ENCODE_VERIFY_LEDS                       256
+#define ENCODE_VERIFY_GUARD                      8    // Words around the output checked for stray writes
+
+// Byte to symbol word lookup, [0] normal and [1] software inverted (PCM and SPI only)
+const uint32_t encode_symbol_table[2][256] =
+{
+    { SYMBOL_WORDS_256(SYMBOL_HIGH, SYMBOL_LOW) },
+    { SYMBOL_WORDS_256(SYMBOL_HIGH_INV, SYMBOL_LOW_INV) },
+};
+
+
+static inline uint32_t get_word(const uint32_t *word, int swap)
+{
+    return swap ? ntohl(*word) : *word;
+}
+
+static inline void put_word(uint32_t *word, uint32_t value, int swap)
+{
+    *word = swap ? htonl(value) : value;
+}
+
+static inline uint8_t led_colour(const encode_channel_t *channel, ws2811_led_t led, int colour)
+{
+    return channel->lut[(led >> channel->shift[colour]) & 0xff];
+}
+
+/**
+ * Pack four consecutive 24-bit symbol words into three output words.
+ *
+ * @param    symbol  Four symbol words in wire order.
+ * @param    words   Word aligned output.
+ * @param    stride  Distance between output words.
+ * @param    swap    Store big endian.
+ *
+ * @returns  None
+ */
+static inline void pack_symbols(const uint32_t *symbol, uint32_t *words, int stride, int swap)
+{
+    put_word(&words[0], (symbol[0] << 8) | (symbol[1] >> 16), swap);
+    put_word(&words[stride], (symbol[1] << 16) | (symbol[2] >> 8), swap);
+    put_word(&words[stride * 2], (symbol[2] << 24) | symbol[3], swap);
+}
+
+/**
+ * Table driven encoder for LEDs [start, count) at an arbitrary bit position.  This is the
+ * reference every other kernel is verified against.  The layout arguments are compile time
+ * constants in the specialised encoders below.
+ *
+ * @param    channel  Channel to encode.
+ * @param    start    First LED to encode.
+ * @param    stream   Output position, updated on return.
+ * @param    stride   Distance between output words.
+ * @param    swap     Store words big endian.
+ * @param    invert   Use the software inverted symbols.
+ * @param    colours  Bytes per LED.
+ *
+ * @returns  None
+ */
+static inline __attribute__((always_inline))
+void encode_leds_table(const encode_channel_t *channel, int start, encode_stream_t *stream,
+                       const int stride, const int swap, const int invert, const int colours)
+{
+    const uint32_t *symbols = encode_symbol_table[invert];
+    uint32_t *words = stream->words;
+    int bitpos = stream->bitpos;
+    uint32_t word = 0;
+    int i, j;
+
+    if (start >= channel->count)
+    {
+        return;
+    }
+
+    // Keep any bits a previous channel already placed in a partially used word
+    if (bitpos != 31)
+    {
+        word = get_word(words, swap) & ~((2u << bitpos) - 1);
+    }
+
+    for (i = start; i < channel->count; i++)                // Led
+    {
+        for (j = 0; j < colours; j++)                       // Color
+        {
+            uint32_t symbol = symbols[led_colour(channel, channel->leds[i], j)];
+
+            if (bitpos >= ENCODE_SYMBOL_BITS - 1)           // Fits in the current word
+            {
+                word |= symbol << (bitpos - (ENCODE_SYMBOL_BITS - 1));
+                bitpos -= ENCODE_SYMBOL_BITS;
+                if (bitpos < 0)
+                {
+                    put_word(words, word, swap);
+                    words += stride;
+                    word = 0;
+                    bitpos = 31;
+                }
+            }
+            else                                            // Split across two words
+            {
+                int spill = (ENCODE_SYMBOL_BITS - 1) - bitpos;
+
+                put_word(words, word | (symbol >> spill), swap);
+                words += stride;
+                word = symbol << (32 - spill);
+                bitpos = 31 - spill;
+            }
+        }
+    }
+
+    // Flush the last partially filled word, leaving the bits after it untouched
+    if (bitpos != 31)
+    {
+        put_word(words, word | (get_word(words, swap) & ((1u << (bitpos + 1)) - 1)), swap);
+    }
+
+    stream->words = words;
+    stream->bitpos = bitpos;
+}
+
+/**
+ * Swizzle and brightness/gamma lookup for a group of LEDs, producing the colour bytes in wire
+ * order.
+ */
+static inline void led_bytes(const encode_channel_t *channel, int start, int count, uint8_t *bytes)
+{
+    int i, j;
+
+    for (i = start; i < start + count; i++)
+    {
+        for (j = 0; j < channel->colours; j++)
+        {
+            *bytes++ = led_colour(channel, channel->leds[i], j);
+        }
+    }
+}
+
+/**
+ * Portable bulk encoder, one table lookup per colour byte.
+ */
+static inline __attribute__((always_inline))
+void encode_bulk_table(const encode_channel_t *channel, int start, int count, uint32_t *words,
+                       const int stride, const int swap, const int invert, const int colours)
+{
+    const uint32_t *symbols = encode_symbol_table[invert];
+    uint32_t symbol[16];
+    int i, j, k;
+
+    for (i = start; i < start + count; i += 4)
+    {
+        for (k = 0; k < 4; k++)
+        {
+            for (j = 0; j < colours; j++)
+            {
+                symbol[k * colours + j] = symbols[led_colour(channel, channel->leds[i + k], j)];
+            }
+        }
+
+        for (k = 0; k < 4 * colours; k += 4)
+        {
+            pack_symbols(&symbol[k], words, stride, swap);
+            words += 3 * stride;
+        }
+    }
+}
+
+static void encode_kernel_scalar(const encode_channel_t *channel, int start, int count,
+                                 uint32_t *words, int stride, int swap)
+{
+    encode_bulk_table(channel, start, count, words, stride, swap, channel->invert, channel->colours);
+}
+
+/*
+ * The vector kernels compute the symbol words arithmetically instead of looking them up: the
+ * 8 bits of a byte lane are spread to bit positions 0, 3, .., 21 and OR'd with the constant
+ * outer bits of every symbol.  Four symbol words (12 significant bytes) are then packed into
+ * three output words with a single byte shuffle.
+ *
+ * Shuffle indices for one group of four 32-bit symbol lanes, as little endian output words
+ * or, for SPI, as a byte stream.
+ */
+#define PACK_WORDS_INDEX                         6, 0, 1, 2, 9, 10, 4, 5, 12, 13, 14, 8
+#define PACK_BYTES_INDEX                         2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12
+
+#ifdef ENCODE_X86
+
+__attribute__((target("ssse3")))
+static inline __m128i spread_ssse3(__m128i x, __m128i base)
+{
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 8)), _mm_set1_epi32(0x00f00f));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 4)), _mm_set1_epi32(0x0c30c3));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 2)), _mm_set1_epi32(0x249249));
+
+    return _mm_or_si128(base, _mm_slli_epi32(x, 1));
+}
+
+__attribute__((target("ssse3")))
+static inline void store_ssse3(__m128i x, uint32_t *words, int stride)
+{
+    if (stride == 1)
+    {
+        _mm_storel_epi64((__m128i *)words, x);
+        words[2] = _mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+    }
+    else
+    {
+        words[0] = _mm_cvtsi128_si32(x);
+        words[stride] = _mm_cvtsi128_si32(_mm_srli_si128(x, 4));
+        words[stride * 2] = _mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+    }
+}
+
+__attribute__((target("ssse3")))
+static void encode_kernel_ssse3(const encode_channel_t *channel, int start, int count,
+                                uint32_t *words, int stride, int swap)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i invert = _mm_set1_epi8(channel->invert ? 0xff : 0);
+    const __m128i base = _mm_set1_epi32(channel->invert ? SYMBOL_BASE_INV : SYMBOL_BASE);
+    const __m128i order = swap ? _mm_setr_epi8(PACK_BYTES_INDEX, -1, -1, -1, -1) :
+                                 _mm_setr_epi8(PACK_WORDS_INDEX, -1, -1, -1, -1);
+    const int colours = channel->colours;
+    uint8_t bytes[16];
+    int i, k;
+
+    for (i = start; i < start + count; i += 4)
+    {
+        __m128i v, lo, hi, x[4];
+
+        led_bytes(channel, i, 4, bytes);
+
+        // Widen the 12 or 16 colour bytes into four vectors of 32-bit lanes
+        v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)bytes), invert);
+        lo = _mm_unpacklo_epi8(v, zero);
+        hi = _mm_unpackhi_epi8(v, zero);
+        x[0] = _mm_unpacklo_epi16(lo, zero);
+        x[1] = _mm_unpackhi_epi16(lo, zero);
+        x[2] = _mm_unpacklo_epi16(hi, zero);
+        x[3] = _mm_unpackhi_epi16(hi, zero);
+
+        for (k = 0; k < colours; k++)
+        {
+            store_ssse3(_mm_shuffle_epi8(spread_ssse3(x[k], base), order), words, stride);
+            words += 3 * stride;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void encode_kernel_avx2(const encode_channel_t *channel, int start, int count,
+                               uint32_t *words, int stride, int swap)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i invert = _mm256_set1_epi32(channel->invert ? 0xff : 0);
+    const __m256i base = _mm256_set1_epi32(channel->invert ? SYMBOL_BASE_INV : SYMBOL_BASE);
+    const __m256i rgb = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                         0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i order = swap ?
+        _mm256_setr_epi8(PACK_BYTES_INDEX, -1, -1, -1, -1, PACK_BYTES_INDEX, -1, -1, -1, -1) :
+        _mm256_setr_epi8(PACK_WORDS_INDEX, -1, -1, -1, -1, PACK_WORDS_INDEX, -1, -1, -1, -1);
+    const int colours = channel->colours;
+    const int bulk = count & ~7;
+    uint8_t lut[256 + 4];                                   // gathers read 4 bytes at a time
+    uint8_t bytes[32];
+    int i, j, k;
+
+    memcpy(lut, channel->lut, 256);
+
+    for (i = start; i < start + bulk; i += 8)
+    {
+        __m256i led = _mm256_loadu_si256((const __m256i *)&channel->leds[i]);
+        __m256i wire = _mm256_setzero_si256();
+
+        // Colour order swizzle and brightness/gamma lookup for eight LEDs, merged into one
+        // wire order word per LED
+        for (j = 0; j < colours; j++)
+        {
+            __m256i c = _mm256_and_si256(_mm256_srl_epi32(led, _mm_cvtsi32_si128(channel->shift[j])), mask);
+
+            c = _mm256_and_si256(_mm256_i32gather_epi32((const int *)lut, c, 1), mask);
+            wire = _mm256_or_si256(wire, _mm256_slli_epi32(c, 8 * j));
+        }
+
+        if (colours == 3)
+        {
+            // Squeeze out the unused top byte, 12 bytes per 128-bit lane
+            wire = _mm256_shuffle_epi8(wire, rgb);
+            _mm_storeu_si128((__m128i *)&bytes[0], _mm256_castsi256_si128(wire));
+            _mm_storeu_si128((__m128i *)&bytes[12], _mm256_extracti128_si256(wire, 1));
+        }
+        else
+        {
+            _mm256_storeu_si256((__m256i *)bytes, wire);
+        }
+
+        // Eight colour bytes, i.e. eight symbol words, per iteration
+        for (k = 0; k < 8 * colours; k += 8)
+        {
+            __m256i x = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&bytes[k]));
+
+            x = _mm256_xor_si256(x, invert);
+            x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 8)), _mm256_set1_epi32(0x00f00f));
+            x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 4)), _mm256_set1_epi32(0x0c30c3));
+            x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 2)), _mm256_set1_epi32(0x249249));
+            x = _mm256_shuffle_epi8(_mm256_or_si256(base, _mm256_slli_epi32(x, 1)), order);
+
+            store_ssse3(_mm256_castsi256_si128(x), words, stride);
+            store_ssse3(_mm256_extracti128_si256(x, 1), words + 3 * stride, stride);
+            words += 6 * stride;
+        }
+    }
+
+    // Left over group of four
+    if (bulk != count)
+    {
+        encode_kernel_ssse3(channel, start + bulk, count - bulk, words, stride, swap);
+    }
+}
+
+static int encode_supported_ssse3(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+
+static int encode_supported_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif /* ENCODE_X86 */
+
+#ifdef ENCODE_NEON
+
+static inline uint32x4_t spread_neon(uint32x4_t x, uint32x4_t base)
+{
+    x = vandq_u32(vorrq_u32(x, vshlq_n_u32(x, 8)), vdupq_n_u32(0x00f00f));
+    x = vandq_u32(vorrq_u32(x, vshlq_n_u32(x, 4)), vdupq_n_u32(0x0c30c3));
+    x = vandq_u32(vorrq_u32(x, vshlq_n_u32(x, 2)), vdupq_n_u32(0x249249));
+
+    return vorrq_u32(base, vshlq_n_u32(x, 1));
+}
+
+static void encode_kernel_neon(const encode_channel_t *channel, int start, int count,
+                               uint32_t *words, int stride, int swap)
+{
+    static const uint8_t pack_words[16] = { PACK_WORDS_INDEX, 0, 0, 0, 0 };
+    static const uint8_t pack_bytes[16] = { PACK_BYTES_INDEX, 0, 0, 0, 0 };
+    const uint8x16_t invert = vdupq_n_u8(channel->invert ? 0xff : 0);
+    const uint32x4_t base = vdupq_n_u32(channel->invert ? SYMBOL_BASE_INV : SYMBOL_BASE);
+    const uint8_t *index = swap ? pack_bytes : pack_words;
+#if defined(__aarch64__)
+    const uint8x16_t order = vld1q_u8(index);
+#else
+    const uint8x8_t order_lo = vld1_u8(index);
+    const uint8x8_t order_hi = vld1_u8(index + 8);
+#endif
+    const int colours = channel->colours;
+    uint8_t bytes[16];
+    uint32_t packed[4];
+    int i, k;
+
+    for (i = start; i < start + count; i += 4)
+    {
+        uint16x8_t lo, hi;
+        uint32x4_t x[4];
+
+        led_bytes(channel, i, 4, bytes);
+
+        // Widen the 12 or 16 colour bytes into four vectors of 32-bit lanes
+        uint8x16_t v = veorq_u8(vld1q_u8(bytes), invert);
+        lo = vmovl_u8(vget_low_u8(v));
+        hi = vmovl_u8(vget_high_u8(v));
+        x[0] = vmovl_u16(vget_low_u16(lo));
+        x[1] = vmovl_u16(vget_high_u16(lo));
+        x[2] = vmovl_u16(vget_low_u16(hi));
+        x[3] = vmovl_u16(vget_high_u16(hi));
+
+        for (k = 0; k < colours; k++)
+        {
+            uint8x16_t s = vreinterpretq_u8_u32(spread_neon(x[k], base));
+
+#if defined(__aarch64__)
+            vst1q_u8((uint8_t *)packed, vqtbl1q_u8(s, order));
+#else
+            uint8x8x2_t t = { { vget_low_u8(s), vget_high_u8(s) } };
+            vst1_u8((uint8_t *)packed, vtbl2_u8(t, order_lo));
+            vst1_u8((uint8_t *)packed + 8, vtbl2_u8(t, order_hi));
+#endif
+            words[0] = packed[0];
+            words[stride] = packed[1];
+            words[stride * 2] = packed[2];
+            words += 3 * stride;
+        }
+    }
+}
+
+static int encode_supported_neon(void)
+{
+#if defined(__aarch64__)
+    return 1;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+
+#endif /* ENCODE_NEON */
+
+
+// Candidate kernels, the scalar kernel is always available.
+const encode_kernel_desc_t encode_kernels[] =
+{
+#ifdef ENCODE_NEON
+    { "neon", encode_kernel_neon, encode_supported_neon },
+#endif
+#ifdef ENCODE_X86
+    { "avx2", encode_kernel_avx2, encode_supported_avx2 },
+    { "ssse3", encode_kernel_ssse3, encode_supported_ssse3 },
+#endif
+    { "scalar", encode_kernel_scalar, NULL },
+    { NULL, NULL, NULL },
+};
+
+static pthread_once_t encode_once = PTHREAD_ONCE_INIT;
+static const encode_kernel_desc_t *encode_selected;
+
+/**
+ * Check a kernel against the table encoder for every byte value, RGB and RGBW, inverted or
+ * not, interleaved (PWM) and byte stream (SPI) layouts, with an identity and a nonlinear
+ * brightness/gamma table.
+ *
+ * @param    desc  Kernel to verify.
+ *
+ * @returns  0 if the output is bit-exact, -1 otherwise.
+ */
+int encode_verify_kernel(const encode_kernel_desc_t *desc)
+{
+    ws2811_led_t leds[64];
+    uint8_t lut[256];
+    uint32_t expect[ENCODE_WORDS(64, 4) * 2];
+    uint32_t actual[ENCODE_WORDS(64, 4) * 2];
+    int i, variant;
+
+    // 64 LEDs of 4 bytes hold every byte value exactly once
+    for (i = 0; i < 64; i++)
+    {
+        leds[i] = (4 * i) | ((4 * i + 1) << 8) | ((4 * i + 2) << 16) | ((uint32_t)(4 * i + 3) << 24);
+    }
+
+    for (variant = 0; variant < 16; variant++)
+    {
+        int nonlinear = variant & 8;
+        encode_channel_t channel =
+        {
+            .leds = leds,
+            .count = 64,
+            .colours = (variant & 1) ? 4 : 3,
+            .shift = { 8, 16, 0, 24 },
+            .lut = lut,
+            .invert = (variant >> 1) & 1,
+        };
+        encode_stream_t stream =
+        {
+            .words = expect,
+            .bitpos = 31,
+        };
+        int swap = (variant >> 2) & 1;
+        int stride = swap ? 1 : 2;
+
+        for (i = 0; i < 256; i++)
+        {
+            lut[i] = nonlinear ? (i * i * 97) >> 16 : i;
+        }
+
+        memset(expect, 0xa5, sizeof(expect));
+        memset(actual, 0xa5, sizeof(actual));
+
+        encode_leds_table(&channel, 0, &stream, stride, swap, channel.invert, channel.colours);
+        desc->kernel(&channel, 0, channel.count, actual, stride, swap);
+
+        if (memcmp(expect, actual, sizeof(expect)))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t verify_random(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+
+    return *seed >> 8 ^ *seed << 13;
+}
+
+/**
+ * Randomised differential check of a kernel against the table encoder.  Every round encodes
+ * random LEDs with a random brightness/gamma table, colour order, layout and range of LEDs
+ * through both and compares the output, including the words around it.  The table encoder's
+ * output is also decoded again and checked against the input, so a fault in the reference
+ * shows up too.
+ *
+ * @param    desc    Kernel to verify.
+ * @param    seed    Start of the random sequence, the same seed repeats the same rounds.
+ * @param    rounds  Number of rounds.
+ *
+ * @returns  0 if every round matches, -1 otherwise.
+ */
+int encode_verify_random(const encode_kernel_desc_t *desc, uint32_t seed, int rounds)
+{
+    static const uint8_t shifts[4] = { 0, 8, 16, 24 };
+    ws2811_led_t leds[ENCODE_VERIFY_LEDS];
+    ws2811_led_t decoded[ENCODE_VERIFY_LEDS];
+    uint32_t expect[(ENCODE_WORDS(ENCODE_VERIFY_LEDS, 4) + ENCODE_VERIFY_GUARD * 2) * 2];
+    uint32_t actual[(ENCODE_WORDS(ENCODE_VERIFY_LEDS, 4) + ENCODE_VERIFY_GUARD * 2) * 2];
+    uint8_t lut[256];
+    int round, i, j;
+
+    for (round = 0; round < rounds; round++)
+    {
+        int layout = verify_random(&seed) % ENCODE_LAYOUTS;
+        int stride = (layout == ENCODE_LAYOUT_PWM) ? 2 : 1;
+        int swap = (layout == ENCODE_LAYOUT_SPI);
+        int count = 4 + (verify_random(&seed) % (ENCODE_VERIFY_LEDS / 4)) * 4;
+        int start = (verify_random(&seed) % (count / 4)) * 4;
+        encode_channel_t channel =
+        {
+            .leds = leds,
+            .count = count,
+            .colours = (verify_random(&seed) & 1) ? 4 : 3,
+            .lut = lut,
+            .invert = verify_random(&seed) & 1,
+        };
+        encode_stream_t stream =
+        {
+            .words = expect + ENCODE_VERIFY_GUARD * stride,
+            .bitpos = 31,
+        };
+        decode_format_t format =
+        {
+            .layout = layout,
+            .invert = channel.invert,
+            .colours = channel.colours,
+        };
+
+        // Any order of the four colour bytes
+        memcpy(channel.shift, shifts, sizeof(shifts));
+        for (i = 3; i > 0; i--)
+        {
+            uint8_t shift = channel.shift[i];
+
+            j = verify_random(&seed) % (i + 1);
+            channel.shift[i] = channel.shift[j];
+            channel.shift[j] = shift;
+        }
+        memcpy(format.shift, channel.shift, sizeof(format.shift));
+        for (i = 0; i < 256; i++)
+        {
+            lut[i] = verify_random(&seed);
+        }
+        for (i = 0; i < count; i++)
+        {
+            leds[i] = verify_random(&seed) ^ (verify_random(&seed) << 16);
+        }
+
+        memset(expect, 0xa5, sizeof(expect));
+        memset(actual, 0xa5, sizeof(actual));
+
+        encode_leds_table(&channel, start, &stream, stride, swap, channel.invert, channel.colours);
+        desc->kernel(&channel, start, count - start, actual + ENCODE_VERIFY_GUARD * stride,
+                     stride, swap);
+
+        if (memcmp(expect, actual, sizeof(expect)))
+        {
+            return -1;
+        }
+
+        if (decode_channel(expect + ENCODE_VERIFY_GUARD * stride, ENCODE_WORDS(count - start, 4),
+                           31, &format, decoded, count - start, NULL) != count - start)
+        {
+            return -1;
+        }
+
+        for (i = start; i < count; i++)
+        {
+            ws2811_led_t value = 0;
+
+            for (j = 0; j < channel.colours; j++)
+            {
+                value |= (ws2811_led_t)led_colour(&channel, leds[i], j) << channel.shift[j];
+            }
+
+            if (decoded[i - start] != value)
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Time a kernel on a typical RGB channel.
+ *
+ * @param    desc     Kernel to time.
+ * @param    channel  Calibration channel.
+ * @param    words    Output buffer large enough for the channel.
+ *
+ * @returns  Best of a few runs in nanoseconds.
+ */
+static uint64_t encode_time_kernel(const encode_kernel_desc_t *desc, const encode_channel_t *channel,
+                                   uint32_t *words)
+{
+    uint64_t best = UINT64_MAX;
+    int run;
+
+    for (run = 0; run < ENCODE_CALIBRATE_RUNS; run++)
+    {
+        struct timespec t0, t1;
+        uint64_t ns;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        desc->kernel(channel, 0, channel->count, words, 1, 0);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        ns = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 + (t1.tv_nsec - t0.tv_nsec);
+        if (ns < best)
+        {
+            best = ns;
+        }
+    }
+
+    return best;
+}
+
+static void encode_select(void)
+{
+    static ws2811_led_t leds[ENCODE_CALIBRATE_LEDS];
+    uint8_t lut[256];
+    uint64_t best = UINT64_MAX;
+    const encode_kernel_desc_t *desc;
+    uint32_t *words;
+    uint32_t seed = 1;
+    int i;
+
+    for (i = 0; i < ENCODE_CALIBRATE_LEDS; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        leds[i] = seed >> 8;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        lut[i] = i;
+    }
+
+    encode_channel_t channel =
+    {
+        .leds = leds,
+        .count = ENCODE_CALIBRATE_LEDS,
+        .colours = 3,
+        .shift = { 8, 16, 0, 24 },
+        .lut = lut,
+        .invert = 0,
+    };
+
+    // Without a calibration buffer settle for the first kernel that verifies
+    words = malloc(ENCODE_WORDS(ENCODE_CALIBRATE_LEDS, 3) * sizeof(uint32_t));
+
+    for (desc = encode_kernels; desc->name; desc++)
+    {
+        uint64_t ns = 0;
+
+        if ((desc->supported && !desc->supported()) || encode_verify_kernel(desc))
+        {
+            continue;
+        }
+
+        if (words)
+        {
+            ns = encode_time_kernel(desc, &channel, words);
+        }
+
+        if (!encode_selected || (ns < best))
+        {
+            encode_selected = desc;
+            best = ns;
+        }
+
+        if (!words)
+        {
+            break;
+        }
+    }
+
+    free(words);
+}
+
+/**
+ * Select the kernel the CPU supports whose output matches the table encoder and which encodes
+ * the calibration channel fastest.  Safe to call more than once and from several threads.
+ *
+ * @returns  None
+ */
+void encode_init(void)
+{
+    pthread_once(&encode_once, encode_select);
+}
+
+const encode_kernel_desc_t *encode_get_kernel(void)
+{
+    encode_init();
+
+    return encode_selected;
+}
+
+/**
+ * Encode one channel into the output stream.  Word aligned groups of four LEDs go through the
+ * selected bulk kernel, anything else through the table encoder.  Only ever instantiated with
+ * constant layout arguments, see ENCODE_RENDER().
+ *
+ * @param    channel  Channel to encode.
+ * @param    stream   Output position, updated on return.
+ *
+ * @returns  None
+ */
+static inline __attribute__((always_inline))
+void encode_channel(const encode_channel_t *channel, encode_stream_t *stream,
+                    const int stride, const int swap, const int invert, const int colours)
+{
+    const encode_kernel_desc_t *desc = encode_selected;
+    int done = 0;
+
+    if (stream->bitpos == 31)
+    {
+        int bulk = channel->count & ~3;
+
+        if (bulk)
+        {
+            if (desc->kernel == encode_kernel_scalar)
+            {
+                encode_bulk_table(channel, 0, bulk, stream->words, stride, swap, invert, colours);
+            }
+            else
+            {
+                desc->kernel(channel, 0, bulk, stream->words, stride, swap);
+            }
+            stream->words += ENCODE_WORDS(bulk, colours) * stride;
+            done = bulk;
+        }
+    }
+
+    encode_leds_table(channel, done, stream, stride, swap, invert, colours);
+}
+
+#define ENCODE_RENDER(name, stride, swap, invert, colours)                                 \
+    static void encode_render_##name(const encode_channel_t *channel, encode_stream_t *stream) \
+    {                                                                                      \
+        encode_channel(channel, stream, stride, swap, invert, colours);                    \
+    }
+
+// PWM inverts in hardware, so there is no inverted PWM variant
+ENCODE_RENDER(pwm_rgb,      2, 0, 0, 3)
+ENCODE_RENDER(pwm_rgbw,     2, 0, 0, 4)
+ENCODE_RENDER(pcm_rgb,      1, 0, 0, 3)
+ENCODE_RENDER(pcm_rgbw,     1, 0, 0, 4)
+ENCODE_RENDER(pcm_rgb_inv,  1, 0, 1, 3)
+ENCODE_RENDER(pcm_rgbw_inv, 1, 0, 1, 4)
+ENCODE_RENDER(spi_rgb,      1, 1, 0, 3)
+ENCODE_RENDER(spi_rgbw,     1, 1, 0, 4)
+ENCODE_RENDER(spi_rgb_inv,  1, 1, 1, 3)
+ENCODE_RENDER(spi_rgbw_inv, 1, 1, 1, 4)
+
+// Indexed by [layout][invert][rgbw]
+static const encode_render_t encode_renders[ENCODE_LAYOUTS][2][2] =
+{
+    [ENCODE_LAYOUT_PWM] =
+    {
+        { encode_render_pwm_rgb, encode_render_pwm_rgbw },
+        { encode_render_pwm_rgb, encode_render_pwm_rgbw },
+    },
+    [ENCODE_LAYOUT_PCM] =
+    {
+        { encode_render_pcm_rgb, encode_render_pcm_rgbw },
+        { encode_render_pcm_rgb_inv, encode_render_pcm_rgbw_inv },
+    },
+    [ENCODE_LAYOUT_SPI] =
+    {
+        { encode_render_spi_rgb, encode_render_spi_rgbw },
+        { encode_render_spi_rgb_inv, encode_render_spi_rgbw_inv },
+    },
+};
+
+/**
+ * Look up the encoder specialised for an output layout and strip type.  Also selects the bulk
+ * kernel if that has not happened yet.
+ *
+ * @param    layout   One of ENCODE_LAYOUT_xxx.
+ * @param    invert   Channel output is inverted.
+ * @param    colours  Bytes per LED, 3 or 4.
+ *
+ * @returns  Encoder for the channel.
+ */
+encode_render_t encode_get_render(int layout, int invert, int colours)
+{
+    encode_init();
+
+    return encode_renders[layout][!!invert][colours == 4];
+}
+
+/*
+ * Worker pool.  The calling thread takes jobs as well, so a pool of n workers encodes on n + 1
+ * threads.  Jobs are handed out through an atomic index, the mutex only guards the start and
+ * end of a batch.  A batch is over once every worker that joined it has left again, so no
+ * worker can still be taking jobs when the next batch is posted.
+ */
+struct encode_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t start;                        //< Signalled when a batch is posted
+    pthread_cond_t done;                         //< Signalled when the last job of a batch ends
+    pthread_t *threads;
+    int workers;
+    int stop;
+    unsigned generation;                         //< Incremented for every batch
+    encode_job_t *jobs;
+    int count;
+    int next;                                    //< Next job to take
+    int active;                                  //< Workers inside the current batch
+};
+
+/**
+ * Take and run jobs of the current batch until there are none left.
+ *
+ * @param    pool  Pool.
+ *
+ * @returns  None
+ */
+static void encode_pool_work(encode_pool_t *pool)
+{
+    int job;
+
+    while ((job = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+    {
+        encode_job_t *j = &pool->jobs[job];
+
+        j->render(&j->channel, &j->stream);
+    }
+}
+
+static void *encode_pool_thread(void *arg)
+{
+    encode_pool_t *pool = arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (!pool->stop && (pool->generation == seen))
+        {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stop)
+        {
+            break;
+        }
+        seen = pool->generation;
+
+        // Too late for this batch, the caller may already be done with it
+        if (__atomic_load_n(&pool->next, __ATOMIC_RELAXED) >= pool->count)
+        {
+            continue;
+        }
+        pool->active++;
+
+        pthread_mutex_unlock(&pool->lock);
+        encode_pool_work(pool);
+        pthread_mutex_lock(&pool->lock);
+
+        if (!--pool->active)
+        {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/**
+ * Start a pool of worker threads.
+ *
+ * @param    workers  Number of threads besides the caller.
+ *
+ * @returns  Pool or NULL on error.
+ */
+encode_pool_t *encode_pool_create(int workers)
+{
+    encode_pool_t *pool = calloc(1, sizeof(*pool));
+    int i;
+
+    if (!pool)
+    {
+        return NULL;
+    }
+
+    pool->threads = calloc(workers, sizeof(pthread_t));
+    if (!pool->threads)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i < workers; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, encode_pool_thread, pool))
+        {
+            break;
+        }
+        pool->workers++;
+    }
+
+    if (pool->workers != workers)
+    {
+        encode_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+/**
+ * Stop the workers and free the pool.
+ *
+ * @param    pool  Pool, may be NULL.
+ *
+ * @returns  None
+ */
+void encode_pool_destroy(encode_pool_t *pool)
+{
+    int i;
+
+    if (!pool)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->workers; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+/**
+ * Run a batch of jobs on the pool and the calling thread, returning when all are done.
+ *
+ * @param    pool   Pool.
+ * @param    jobs   Jobs, their streams are updated as by the render functions.
+ * @param    count  Number of jobs.
+ *
+ * @returns  None
+ */
+void encode_pool_run(encode_pool_t *pool, encode_job_t *jobs, int count)
+{
+    if (!count)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs = jobs;
+    pool->count = count;
+    pool->next = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    encode_pool_work(pool);
+
+    // All jobs have been taken, wait for the workers still running one
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,113 @@
+/*
+ * encode.h
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef __ENCODE_H__
+#define __ENCODE_H__
+
+#include "ws2811.h"
+
+
+/*
+ * Per channel input to the encoder for a single frame.  Colours are listed in wire order,
+ * shift[0] selects the byte sent first.
+ */
+typedef struct
+{
+    const ws2811_led_t *leds;                    //< LED buffer of the channel
+    int count;                                   //< Number of LEDs to encode
+    int colours;                                 //< Bytes per LED, 3 (RGB) or 4 (RGBW)
+    uint8_t shift[4];                            //< Bit position of each colour in an LED word
+    const uint8_t *lut;                          //< Brightness and gamma correction in one table
+    int invert;                                  //< Software inversion of the symbols
+} encode_channel_t;
+
+/*
+ * Output position in the DMA/SPI buffer.  Words are filled MSB first, bitpos carries over from
+ * one channel to the next exactly as the hardware sees it.
+ */
+typedef struct
+{
+    uint32_t *words;                             //< Next word to write
+    int bitpos;                                  //< Next free bit in *words, 31 if word aligned
+} encode_stream_t;
+
+// Output buffer layouts
+#define ENCODE_LAYOUT_PWM                        0  // Words interleaved with the other channel
+#define ENCODE_LAYOUT_PCM                        1  // Consecutive words
+#define ENCODE_LAYOUT_SPI                        2  // Byte stream, MSB first
+#define ENCODE_LAYOUTS                           3
+
+// Encoder for one channel, specialised for layout, inversion and colour count
+typedef void (*encode_render_t)(const encode_channel_t *channel, encode_stream_t *stream);
+
+/*
+ * Bulk kernel.  Encodes LEDs [start, start + count) into word aligned output, count must be a
+ * multiple of 4 so that the last symbol ends on a word boundary.
+ */
+typedef void (*encode_kernel_t)(const encode_channel_t *channel, int start, int count,
+                                uint32_t *words, int stride, int swap);
+
+typedef struct
+{
+    const char *name;
+    encode_kernel_t kernel;
+    int (*supported)(void);
+} encode_kernel_desc_t;
+
+#define ENCODE_SYMBOL_BITS                       24
+#define ENCODE_WORDS(leds, colours)              (((leds) * (colours) * ENCODE_SYMBOL_BITS) / 32)
+
+/*
+ * A piece of a frame for the worker pool: one channel, or a range of LEDs of one channel
+ * starting on a word boundary.  Jobs of a frame never write the same output word.
+ */
+typedef struct
+{
+    encode_render_t render;
+    encode_channel_t channel;
+    encode_stream_t stream;
+} encode_job_t;
+
+typedef struct encode_pool encode_pool_t;
+
+extern const uint32_t encode_symbol_table[2][256];
+extern const encode_kernel_desc_t encode_kernels[];
+
+void encode_init(void);                                                //< Select the fastest verified kernel
+encode_pool_t *encode_pool_create(int workers);                        //< Start worker threads
+void encode_pool_destroy(encode_pool_t *pool);                         //< Stop and free the workers
+void encode_pool_run(encode_pool_t *pool, encode_job_t *jobs, int count);  //< Run jobs to completion
+const encode_kernel_desc_t *encode_get_kernel(void);                   //< Currently selected kernel
+int encode_verify_kernel(const encode_kernel_desc_t *desc);            //< 0 if bit-exact with the table encoder
+int encode_verify_random(const encode_kernel_desc_t *desc, uint32_t seed, int rounds);  //< Randomised check against the table encoder
+encode_render_t encode_get_render(int layout, int invert, int colours);  //< Specialised channel encoder
+
+
+#endif /* __ENCODE_H__ */
@@ -0,0 +1,139 @@
+/*
+ * inject.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ws2811.h"
+#include "inject.h"
+#include "monotonic.h"
+
+
+/**
+ * Empty a queue and clear its counters.  Not safe against concurrent pushes.
+ *
+ * @param    queue  Queue.
+ *
+ * @returns  None
+ */
+void inject_queue_init(inject_queue_t *queue)
+{
+    uint32_t i;
+
+    memset(queue, 0, sizeof(*queue));
+
+    for (i = 0; i < INJECT_QUEUE_SIZE; i++)
+    {
+        queue->slot[i].seq = i;
+    }
+}
+
+/**
+ * Queue an injected event, stamped with the time its slot was claimed.  Safe from any number
+ * of threads at once, it never blocks.  Producers racing each other may stamp their events
+ * slightly out of queue order.
+ *
+ * @param    queue      Queue.
+ * @param    color      Color.
+ * @param    intensity  Intensity in percent.
+ *
+ * @returns  0 on success, -1 if the queue was full and the event dropped.
+ */
+int inject_queue_push(inject_queue_t *queue, ws2811_led_t color, uint32_t intensity)
+{
+    uint32_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        uint32_t seq = __atomic_load_n(&queue->slot[pos % INJECT_QUEUE_SIZE].seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)(seq - pos);
+
+        if (!diff)
+        {
+            // Free for this lap, claim it unless another producer got there first
+            if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Still holding an event from the previous lap
+            __atomic_fetch_add(&queue->dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    queue->slot[pos % INJECT_QUEUE_SIZE].event.color = color;
+    queue->slot[pos % INJECT_QUEUE_SIZE].event.intensity = intensity;
+    queue->slot[pos % INJECT_QUEUE_SIZE].event.time_ns = monotonic_ns();
+    __atomic_store_n(&queue->slot[pos % INJECT_QUEUE_SIZE].seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&queue->pushed, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/**
+ * Take the events queued so far, oldest first.  Only one thread may drain a queue.  An event
+ * still being written by its producer ends the batch, it comes with the next one.
+ *
+ * @param    queue   Queue.
+ * @param    events  Filled with the events.
+ * @param    max     Room in events.
+ *
+ * @returns  Number of events taken.
+ */
+int inject_queue_drain(inject_queue_t *queue, inject_event_t *events, int max)
+{
+    int count = 0;
+
+    while (count < max)
+    {
+        uint32_t pos = queue->tail;
+        uint32_t seq = __atomic_load_n(&queue->slot[pos % INJECT_QUEUE_SIZE].seq, __ATOMIC_ACQUIRE);
+
+        if (seq != pos + 1)
+        {
+            break;
+        }
+
+        events[count++] = queue->slot[pos % INJECT_QUEUE_SIZE].event;
+        __atomic_store_n(&queue->slot[pos % INJECT_QUEUE_SIZE].seq, pos + INJECT_QUEUE_SIZE,
+                         __ATOMIC_RELEASE);
+        queue->tail = pos + 1;
+    }
+
+    return count;
+}
@@ -0,0 +1,80 @@
+/*
+ * inject.h
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef __INJECT_H__
+#define __INJECT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ws2811.h"
+
+
+#define INJECT_QUEUE_SIZE                        64  // Power of 2
+
+typedef struct
+{
+    ws2811_led_t color;                          //< Color injected
+    uint32_t intensity;                          //< Intensity in percent
+    uint64_t time_ns;                            //< CLOCK_MONOTONIC time of the injection
+} inject_event_t;
+
+/*
+ * Bounded lock-free queue of injected events.  Any number of threads can push, never
+ * blocking, and the one thread ticking the pattern drains them.  Every slot carries a
+ * sequence number telling whose turn it is: a producer claims a slot by moving head on, the
+ * consumer frees it by moving the sequence a lap ahead.  A full queue drops the event and
+ * counts it.
+ */
+typedef struct
+{
+    struct
+    {
+        uint32_t seq;                            //< Position the slot is free for, or filled at + 1
+        inject_event_t event;
+    } slot[INJECT_QUEUE_SIZE];
+    uint32_t head;                               //< Next position to push, shared by producers
+    uint32_t tail;                               //< Next position to drain, consumer only
+    uint64_t pushed;                             //< Events queued
+    uint64_t dropped;                            //< Events lost to a full queue
+} inject_queue_t;
+
+void inject_queue_init(inject_queue_t *queue);   //< Empty the queue and clear the counters
+int inject_queue_push(inject_queue_t *queue, ws2811_led_t color,
+                      uint32_t intensity);       //< Queue an event, -1 if full and dropped
+int inject_queue_drain(inject_queue_t *queue, inject_event_t *events,
+                       int max);                 //< Take up to max events, oldest first
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __INJECT_H__ */
@@ -0,0 +1,249 @@
+/*
+ * layout.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "ws2811.h"
+#include "layout.h"
+
+
+/**
+ * Allocate the map of a layout with every strip LED dark.
+ *
+ * @param    layout  Layout.
+ * @param    width   Matrix width.
+ * @param    height  Matrix height.
+ * @param    count   Strip LEDs.
+ *
+ * @returns  0 on success, < 0 otherwise.
+ */
+static ws2811_return_t layout_alloc(layout_t *layout, int width, int height, int count)
+{
+    int i;
+
+    layout->map = NULL;
+
+    if ((width <= 0) || (height <= 0) || (count < width * height))
+    {
+        fprintf(stderr, "Layout of %dx%d does not fit %d LEDs\n", width, height, count);
+        return WS2811_ERROR_GENERIC;
+    }
+
+    layout->map = malloc(sizeof(uint32_t) * count);
+    if (!layout->map)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        layout->map[i] = WS2811_MAP_NONE;
+    }
+
+    layout->width = width;
+    layout->height = height;
+    layout->count = count;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Build the map of a matrix wired row by row.  The matrix is mirrored and transposed first,
+ * then the strip runs through the rows of the result.  Strip LEDs past the matrix stay dark.
+ *
+ * @param    layout  Layout.
+ * @param    width   Matrix width.
+ * @param    height  Matrix height.
+ * @param    count   Strip LEDs, at least width * height.
+ * @param    flags   LAYOUT_xxx flags.
+ *
+ * @returns  0 on success, < 0 otherwise.
+ */
+ws2811_return_t layout_init(layout_t *layout, int width, int height, int count, int flags)
+{
+    ws2811_return_t ret;
+    int x, y;
+
+    if ((ret = layout_alloc(layout, width, height, count)) != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    for (y = 0; y < height; y++)
+    {
+        for (x = 0; x < width; x++)
+        {
+            int u = (flags & LAYOUT_MIRROR_X) ? (width - x - 1) : x;
+            int v = (flags & LAYOUT_MIRROR_Y) ? (height - y - 1) : y;
+            int row = width;
+            int reverse;
+
+            if (flags & LAYOUT_TRANSPOSE)
+            {
+                int t = u;
+
+                u = v;
+                v = t;
+                row = height;
+            }
+
+            reverse = !!(flags & LAYOUT_REVERSE);
+            if (flags & LAYOUT_SERPENTINE)
+            {
+                reverse ^= v & 1;
+            }
+            if (reverse)
+            {
+                u = row - u - 1;
+            }
+
+            layout->map[v * row + u] = y * width + x;
+        }
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Read the next number of a layout file, skipping comments from '#' to the end of the line.
+ *
+ * @param    file   File.
+ * @param    value  Filled with the number.
+ *
+ * @returns  0 on success, -1 at the end of the file or on anything but a number.
+ */
+static int layout_read(FILE *file, int *value)
+{
+    int c;
+
+    while ((c = fgetc(file)) != EOF)
+    {
+        if (c == '#')
+        {
+            while (((c = fgetc(file)) != EOF) && (c != '\n'))
+                ;
+        }
+        else if (!isspace(c))
+        {
+            ungetc(c, file);
+            return (fscanf(file, "%d", value) == 1) ? 0 : -1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Read an arbitrary layout from a text file.  The file holds the width and height of the
+ * matrix, then for each matrix LED row by row its position on the strip, or -1 where there is
+ * no LED.  '#' starts a comment.  Strip positions nothing maps to stay dark.
+ *
+ * @param    layout  Layout.
+ * @param    path    File name.
+ * @param    count   Strip LEDs, at least width * height.
+ *
+ * @returns  0 on success, < 0 otherwise.
+ */
+ws2811_return_t layout_load(layout_t *layout, const char *path, int count)
+{
+    ws2811_return_t ret = WS2811_ERROR_GENERIC;
+    FILE *file;
+    int width, height, i;
+
+    layout->map = NULL;
+
+    file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        return WS2811_ERROR_GENERIC;
+    }
+
+    if (layout_read(file, &width) || layout_read(file, &height))
+    {
+        fprintf(stderr, "%s: missing matrix size\n", path);
+        goto done;
+    }
+
+    if ((ret = layout_alloc(layout, width, height, count)) != WS2811_SUCCESS)
+    {
+        goto done;
+    }
+
+    for (i = 0; i < width * height; i++)
+    {
+        int pos;
+
+        if (layout_read(file, &pos))
+        {
+            fprintf(stderr, "%s: %d of %d LED positions\n", path, i, width * height);
+            ret = WS2811_ERROR_GENERIC;
+            break;
+        }
+        if (pos < 0)
+        {
+            continue;
+        }
+        if ((pos >= count) || (layout->map[pos] != WS2811_MAP_NONE))
+        {
+            fprintf(stderr, "%s: LED %d at bad strip position %d\n", path, i, pos);
+            ret = WS2811_ERROR_GENERIC;
+            break;
+        }
+
+        layout->map[pos] = i;
+    }
+
+    if (ret != WS2811_SUCCESS)
+    {
+        layout_fini(layout);
+    }
+
+done:
+    fclose(file);
+
+    return ret;
+}
+
+/**
+ * Free the map of a layout.  Channels still pointing at it must be cleared first.
+ *
+ * @param    layout  Layout.
+ *
+ * @returns  None
+ */
+void layout_fini(layout_t *layout)
+{
+    free(layout->map);
+    layout->map = NULL;
+}
@@ -0,0 +1,75 @@
+/*
+ * layout.h
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef __LAYOUT_H__
+#define __LAYOUT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ws2811.h"
+
+
+// How the rows of a matrix run along the strip, for layout_init()
+#define LAYOUT_SERPENTINE                        0x01  // Rows alternate direction
+#define LAYOUT_REVERSE                           0x02  // First row runs right to left
+#define LAYOUT_MIRROR_X                          0x04  // Mirror the matrix left to right
+#define LAYOUT_MIRROR_Y                          0x08  // Mirror the matrix top to bottom
+#define LAYOUT_TRANSPOSE                         0x10  // Columns run along the strip, not rows
+
+// Matrix turned clockwise on the panel
+#define LAYOUT_ROTATE_90                         (LAYOUT_TRANSPOSE | LAYOUT_MIRROR_Y)
+#define LAYOUT_ROTATE_180                        (LAYOUT_MIRROR_X | LAYOUT_MIRROR_Y)
+#define LAYOUT_ROTATE_270                        (LAYOUT_TRANSPOSE | LAYOUT_MIRROR_X)
+
+/*
+ * Where each LED of a matrix sits on the strip.  Patterns draw the matrix into the LEDs of a
+ * channel in logical order, LED (x, y) at leds[y * width + x], and hand map to the channel.
+ * The driver reads the LEDs through it when encoding, so nothing gets copied per frame.
+ */
+typedef struct
+{
+    int width;                                   //< Matrix width
+    int height;                                  //< Matrix height
+    int count;                                   //< Strip LEDs, at least width * height
+    uint32_t *map;                               //< Matrix LED shown by each strip LED, or WS2811_MAP_NONE
+} layout_t;
+
+ws2811_return_t layout_init(layout_t *layout, int width, int height, int count,
+                            int flags);          //< Build the map of a regular layout
+ws2811_return_t layout_load(layout_t *layout, const char *path, int count);  //< Read the map from a file
+void layout_fini(layout_t *layout);              //< Free the map
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LAYOUT_H__ */
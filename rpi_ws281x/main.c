@@ -42,6 +42,8 @@ static char VERSION[] = "0.0.6";
 #include <signal.h>
 #include <stdarg.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
 
 
 #include "clk.h"
@@ -51,9 +53,15 @@ static char VERSION[] = "0.0.6";
 #include "version.h"
 
 #include "ws2811.h"
+#include "encode.h"
+#include "decode.h"
+#include "sim.h"
+#include "canvas.h"
+#include "monotonic.h"
 #include "pattern.h"
 #include "pattern_rainbow.h"
 #include "pattern_pulse.h"
+#include "scheduler.h"
 #include "log.h"
 
 #define ARRAY_SIZE(stuff)       (sizeof(stuff) / sizeof(stuff[0]))
@@ -72,14 +80,32 @@ static char VERSION[] = "0.0.6";
 #define MOVEMENT_RATE           100
 #define PULSE_WIDTH             10
 
+// --verify
+#define VERIFY_SEED             1
+#define VERIFY_ROUNDS           20000
+#define VERIFY_FRAMES           100
+#define VERIFY_LEDS             64
+#define VERIFY_THREADS          6
+#define VERIFY_THREAD_FRAMES    40
+#define VERIFY_SIM_FRAMES       8
+#define VERIFY_SIM_TOLERANCE_US 20
+#define VERIFY_CANVAS_FRAMES    20
+#define VERIFY_TICK_RATE        200
+#define VERIFY_TICK_TIME_US     100000
+#define VERIFY_PRODUCERS        4
+#define VERIFY_PRODUCER_EVENTS  20000
+#define VERIFY_PRODUCER_BURST   32
+
 static int width = WIDTH;
 static int height = HEIGHT;
 static int led_count = LED_COUNT;
 static int clear_on_exit = 0;
 static struct pattern *pattern;
+static scheduler_t scheduler;
 static double movement_rate = MOVEMENT_RATE;
 static bool maintain_colors = false;
 static uint32_t pulse_width = PULSE_WIDTH;
+static const char *layout_file = NULL;
 int program = 0;
 static uint32_t sleep_rate = SLEEP * 1000000;
 
@@ -113,7 +139,6 @@ static void ctrl_c_handler(int signum)
     log_info("Control+C GET!");
 	(void)(signum);
     running = 0;
-    pattern->func_kill_pattern(pattern);
 }
 
 static void setup_handlers(void)
@@ -127,6 +152,1258 @@ static void setup_handlers(void)
     sigaction(SIGTERM, &sa, NULL);
 }
 
+/**
+ * Render random frames through the memory backend and decode every frame sent.  The LEDs
+ * of a simulated strip keep their colour until a frame updates them, as real ones do, and
+ * after every frame must show exactly what was rendered.
+ *
+ * @param    gpionum  GPIO of channel 0, selects PWM, PCM or SPI.
+ * @param    strip    Strip type of both channels.
+ * @param    invert   Invert the output.
+ * @param    seed     Random sequence.
+ *
+ * @returns  0 if every frame decodes as expected, -1 otherwise.
+ */
+static int verify_frames(int gpionum, int strip, int invert, uint32_t seed)
+{
+    ws2811_t ws2811 =
+    {
+        .freq = TARGET_FREQ,
+        .dmanum = DMA,
+    };
+    const ws2811_led_t mask = (strip & SK6812_SHIFT_WMASK) ? 0xffffffff : 0x00ffffff;
+    ws2811_led_t strip_leds[RPI_PWM_CHANNELS][VERIFY_LEDS] = { { 0 } };
+    ws2811_led_t decoded[VERIFY_LEDS];
+    int frame, chan, i, ret = 0;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        seed = seed * 1103515245 + 12345;
+        ws2811.channel[chan].count = 1 + (seed >> 8) % VERIFY_LEDS;
+        ws2811.channel[chan].invert = invert;
+        ws2811.channel[chan].brightness = 255;
+        ws2811.channel[chan].strip_type = strip;
+    }
+    ws2811.channel[0].gpionum = gpionum;
+
+    // Only PWM has a second channel
+    if (gpionum == 18)
+    {
+        ws2811.channel[1].gpionum = 13;
+    }
+    else
+    {
+        ws2811.channel[1].count = 0;
+    }
+
+    if (ws2811_mem_init(&ws2811) != WS2811_SUCCESS)
+    {
+        return -1;
+    }
+
+    for (frame = 0; (frame < VERIFY_FRAMES) && !ret; frame++)
+    {
+        const uint8_t *data;
+        size_t len;
+
+        // A few LEDs anywhere, or all of them
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            ws2811_channel_t *channel = &ws2811.channel[chan];
+            int changes;
+
+            if (!channel->count)
+            {
+                continue;
+            }
+
+            seed = seed * 1103515245 + 12345;
+            changes = ((seed >> 8) % 4) ? (int)((seed >> 12) % 4) : channel->count;
+            for (i = 0; i < changes; i++)
+            {
+                seed = seed * 1103515245 + 12345;
+                channel->leds[(seed >> 8) % channel->count] = seed ^ (seed << 11);
+            }
+        }
+
+        if (ws2811_render(&ws2811) != WS2811_SUCCESS)
+        {
+            ret = -1;
+            break;
+        }
+
+        data = ws2811_get_mem_frame(&ws2811, &len);
+
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            ws2811_channel_t *channel = &ws2811.channel[chan];
+            decode_error_t error;
+            int count;
+
+            if (!channel->count)
+            {
+                continue;
+            }
+
+            count = ws2811_decode_frame(&ws2811, data, len, chan, decoded, &error);
+            if (count < 0)
+            {
+                fprintf(stderr, "frame %d channel %d: bad symbol %06x at LED %d colour %d\n",
+                        frame, chan, error.symbol, error.led, error.colour);
+                ret = -1;
+                break;
+            }
+
+            memcpy(strip_leds[chan], decoded, count * sizeof(ws2811_led_t));
+            for (i = 0; i < channel->count; i++)
+            {
+                if (strip_leds[chan][i] != (channel->leds[i] & mask))
+                {
+                    fprintf(stderr, "frame %d channel %d: LED %d shows %08x, expected %08x\n",
+                            frame, chan, i, strip_leds[chan][i], channel->leds[i] & mask);
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+    }
+
+    ws2811_fini(&ws2811);
+
+    return ret;
+}
+
+/* One of the instances driven side by side by verify_threads() */
+typedef struct
+{
+    pthread_t thread;
+    int index;
+    int gpionum;
+    int count;
+    int ret;
+} verify_instance_t;
+
+/**
+ * Render frames only this instance would draw, changing every LED each time, and check the
+ * decoded output and that consecutive frames are at least this instance's frame plus reset
+ * time apart.
+ *
+ * @param    arg  verify_instance_t of the thread.
+ *
+ * @returns  NULL, the result is left in the verify_instance_t.
+ */
+static void *verify_thread(void *arg)
+{
+    verify_instance_t *instance = arg;
+    ws2811_t ws2811 =
+    {
+        .freq = TARGET_FREQ,
+        .dmanum = DMA,
+    };
+    ws2811_channel_t *channel = &ws2811.channel[0];
+    ws2811_led_t decoded[VERIFY_LEDS];
+    uint64_t wait_ns = 0, prev_start = 0;
+    int frame, i;
+
+    channel->gpionum = instance->gpionum;
+    channel->count = instance->count;
+    channel->brightness = 255;
+    channel->strip_type = WS2811_STRIP_GRB;
+
+    if (ws2811_mem_init(&ws2811) != WS2811_SUCCESS)
+    {
+        instance->ret = -1;
+        return NULL;
+    }
+
+    for (frame = 0; (frame < VERIFY_THREAD_FRAMES) && !instance->ret; frame++)
+    {
+        const uint8_t *data;
+        decode_error_t error;
+        uint64_t start, done;
+        size_t len;
+        int count;
+
+        for (i = 0; i < channel->count; i++)
+        {
+            channel->leds[i] = (instance->index << 20) | (frame << 8) | i;
+        }
+
+        start = monotonic_ns();
+        if (ws2811_render(&ws2811) != WS2811_SUCCESS)
+        {
+            instance->ret = -1;
+            break;
+        }
+        done = monotonic_ns();
+
+        // The frame goes out after the previous one and its reset are over
+        if (frame && ((done - prev_start) < wait_ns))
+        {
+            fprintf(stderr, "instance %d frame %d: %llu ns after the previous one, needs %llu\n",
+                    instance->index, frame, (unsigned long long)(done - prev_start),
+                    (unsigned long long)wait_ns);
+            instance->ret = -1;
+            break;
+        }
+        prev_start = start;
+        wait_ns = ws2811.render_wait_time * 1000;
+
+        data = ws2811_get_mem_frame(&ws2811, &len);
+        count = ws2811_decode_frame(&ws2811, data, len, 0, decoded, &error);
+        if (count != channel->count)
+        {
+            fprintf(stderr, "instance %d frame %d: decoded %d LEDs, expected %d\n",
+                    instance->index, frame, count, channel->count);
+            instance->ret = -1;
+            break;
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            if (decoded[i] != channel->leds[i])
+            {
+                fprintf(stderr, "instance %d frame %d: LED %d shows %08x, expected %08x\n",
+                        instance->index, frame, i, decoded[i], channel->leds[i]);
+                instance->ret = -1;
+                break;
+            }
+        }
+    }
+
+    ws2811_fini(&ws2811);
+
+    return NULL;
+}
+
+/**
+ * Run several instances on the memory backend at once, each from its own thread and with
+ * its own layout and strip length, so they have different frame times.
+ *
+ * @returns  0 if every instance only saw its own frames at its own pace, -1 otherwise.
+ */
+static int verify_threads(void)
+{
+    static const int gpionums[] = { 18, 21, 10 };
+    verify_instance_t instance[VERIFY_THREADS];
+    int i, started, ret = 0;
+
+    for (started = 0; started < VERIFY_THREADS; started++)
+    {
+        verify_instance_t *inst = &instance[started];
+
+        inst->index = started;
+        inst->gpionum = gpionums[started % ARRAY_SIZE(gpionums)];
+        inst->count = VERIFY_LEDS - started * (VERIFY_LEDS / VERIFY_THREADS);
+        inst->ret = 0;
+        if (pthread_create(&inst->thread, NULL, verify_thread, inst))
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(instance[i].thread, NULL);
+        if (instance[i].ret)
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Render frames through the simulated PWM and PCM hardware, every other one while the frame
+ * before it is still going out.  The DMA must run the two buffers in turn and every transfer
+ * must carry the LEDs of its own frame, not those encoded into the other buffer meanwhile.
+ *
+ * @returns  0 if every transfer decodes to its frame, -1 otherwise.
+ */
+static int verify_sim(void)
+{
+    static const int gpionum[] = { 18, 21 };   // PWM, PCM
+    ws2811_led_t decoded[VERIFY_LEDS];
+    int g, ret = 0;
+
+    for (g = 0; (g < (int)ARRAY_SIZE(gpionum)) && !ret; g++)
+    {
+        ws2811_t ws2811 =
+        {
+            .freq = TARGET_FREQ,
+            .dmanum = DMA,
+        };
+        ws2811_channel_t *channel = &ws2811.channel[0];
+        uint32_t conblk[VERIFY_SIM_FRAMES];
+        int frame, in_flight = 0, i;
+        struct sim *sim;
+
+        channel->gpionum = gpionum[g];
+        channel->count = VERIFY_LEDS;
+        channel->brightness = 255;
+        channel->strip_type = WS2811_STRIP_GRB;
+
+        if ((ws2811_sim_init(&ws2811) != WS2811_SUCCESS) || !(sim = ws2811_get_sim(&ws2811)))
+        {
+            return -1;
+        }
+
+        for (frame = 0; (frame < VERIFY_SIM_FRAMES) && !ret; frame++)
+        {
+            decode_error_t error;
+            int count;
+
+            for (i = 0; i < channel->count; i++)
+            {
+                channel->leds[i] = (gpionum[g] << 16) | (frame << 8) | i;
+            }
+
+            // Let every other frame finish before the next one is encoded
+            if (!(frame & 1))
+            {
+                monotonic_sleep_until(ws2811_get_ready_time(&ws2811));
+            }
+            else if (monotonic_ns() < ws2811_get_ready_time(&ws2811))
+            {
+                in_flight++;
+            }
+
+            if (ws2811_render(&ws2811) != WS2811_SUCCESS)
+            {
+                ret = -1;
+                break;
+            }
+
+            conblk[frame] = sim->last_conblk_ad;
+            if ((sim->transfers != (uint32_t)frame + 1) ||
+                (frame && (conblk[frame] == conblk[frame - 1])) ||
+                ((frame > 1) && (conblk[frame] != conblk[frame - 2])))
+            {
+                fprintf(stderr, "sim gpio %d frame %d: transfer %u ran control block %08x\n",
+                        gpionum[g], frame, sim->transfers, conblk[frame]);
+                ret = -1;
+                break;
+            }
+
+            count = ws2811_decode_frame(&ws2811, sim->frame, sim->frame_len, 0, decoded, &error);
+            if (count != channel->count)
+            {
+                fprintf(stderr, "sim gpio %d frame %d: decoded %d LEDs, expected %d\n",
+                        gpionum[g], frame, count, channel->count);
+                ret = -1;
+                break;
+            }
+
+            for (i = 0; i < count; i++)
+            {
+                if (decoded[i] != channel->leds[i])
+                {
+                    fprintf(stderr, "sim gpio %d frame %d: LED %d shows %08x, expected %08x\n",
+                            gpionum[g], frame, i, decoded[i], channel->leds[i]);
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+
+        // A loaded machine may finish some frames before the next render, not all of them
+        if (!ret && !in_flight)
+        {
+            fprintf(stderr, "sim gpio %d: no frame rendered while another was going out\n",
+                    gpionum[g]);
+            ret = -1;
+        }
+
+        ws2811_fini(&ws2811);
+    }
+
+    return ret;
+}
+
+/**
+ * Render frames through the simulated PWM and PCM hardware running in real time.  Every
+ * transfer must feed the FIFO fast enough to never let it run empty, and its last bit must
+ * leave the serializer the wire time ws2811_get_frame_time() promises after the first one.
+ * Only the first transfer may reset the DMA channel, every later one, also those rendered
+ * back to back, must take the fast path and get its first word out sooner than the reset did.
+ *
+ * @returns  0 if every frame took the wire time it should, -1 otherwise.
+ */
+static int verify_timed_sim(void)
+{
+    static const int gpionum[] = { 18, 21 };   // PWM, PCM
+    int g, ret = 0;
+
+    for (g = 0; (g < (int)ARRAY_SIZE(gpionum)) && !ret; g++)
+    {
+        ws2811_t ws2811 =
+        {
+            .freq = TARGET_FREQ,
+            .dmanum = DMA,
+        };
+        ws2811_channel_t *channel = &ws2811.channel[0];
+        uint64_t frame_ns, reset_latency = 0, fast_latency = UINT64_MAX;
+        ws2811_stats_t stats;
+        int frame, i;
+        struct sim *sim;
+
+        channel->gpionum = gpionum[g];
+        channel->count = VERIFY_LEDS;
+        channel->brightness = 255;
+        channel->strip_type = WS2811_STRIP_GRB;
+
+        if ((ws2811_timed_sim_init(&ws2811) != WS2811_SUCCESS) ||
+            !(sim = ws2811_get_sim(&ws2811)))
+        {
+            return -1;
+        }
+        frame_ns = ws2811_get_frame_time(&ws2811) * 1000ULL;
+
+        for (frame = 0; (frame < VERIFY_SIM_FRAMES) && !ret; frame++)
+        {
+            uint64_t called, start, first_word, end, drain, wire_ns;
+            uint32_t underruns;
+
+            for (i = 0; i < channel->count; i++)
+            {
+                channel->leds[i] = (frame << 8) | i;
+            }
+
+            // Out of the reset time, so the render only encodes and starts
+            monotonic_sleep_until(ws2811_get_ready_time(&ws2811));
+            called = monotonic_ns();
+            if ((ws2811_render(&ws2811) != WS2811_SUCCESS) ||
+                (ws2811_wait(&ws2811) != WS2811_SUCCESS))
+            {
+                ret = -1;
+                break;
+            }
+
+            // The DMA is done, the FIFO still has to drain
+            start = monotonic_ns();
+            while (!__atomic_load_n(&sim->drain_ns, __ATOMIC_ACQUIRE) &&
+                   (monotonic_ns() - start < 1000000000))
+            {
+                usleep(100);
+            }
+
+            start = sim->start_ns;
+            first_word = sim->first_word_ns;
+            end = sim->end_ns;
+            drain = sim->drain_ns;
+            underruns = sim->underruns;
+            wire_ns = drain - first_word;
+
+            if (!start || (first_word < start) || (end < first_word) || (drain < end) ||
+                underruns || (wire_ns + VERIFY_SIM_TOLERANCE_US * 1000 < frame_ns) ||
+                (wire_ns > frame_ns + VERIFY_SIM_TOLERANCE_US * 1000))
+            {
+                fprintf(stderr, "timed sim gpio %d frame %d: first word %lld ns, DMA done "
+                        "%lld ns, drained %lld ns after the start, %u underruns, "
+                        "frame time %llu ns\n", gpionum[g], frame,
+                        (long long)(first_word - start), (long long)(end - start),
+                        (long long)(drain - start), underruns, (unsigned long long)frame_ns);
+                ret = -1;
+            }
+
+            // Start latency as the LEDs see it, render call to the first word on the wire
+            if (!frame)
+            {
+                reset_latency = first_word - called;
+            }
+            else if (first_word - called < fast_latency)
+            {
+                fast_latency = first_word - called;
+            }
+        }
+
+        // Back to back, each render waits for the previous frame to be over
+        for (frame = 0; (frame < VERIFY_SIM_FRAMES) && !ret; frame++)
+        {
+            channel->leds[0] = ~frame;
+            if (ws2811_render(&ws2811) != WS2811_SUCCESS)
+            {
+                ret = -1;
+            }
+        }
+        ws2811_wait(&ws2811);
+
+        ws2811_get_stats(&ws2811, &stats);
+        log_info("timed sim gpio %d: %llu starts, %llu fast, first word %.1f us after the "
+                 "render with a reset, %.1f us without", gpionum[g],
+                 (unsigned long long)stats.starts, (unsigned long long)stats.fast_starts,
+                 reset_latency / 1000.0, fast_latency / 1000.0);
+
+        if (!ret && ((stats.starts != 2 * VERIFY_SIM_FRAMES) ||
+                     (stats.fast_starts != stats.starts - 1) || (fast_latency >= reset_latency)))
+        {
+            fprintf(stderr, "timed sim gpio %d: %llu of %llu starts took the fast path, it got "
+                    "the first word out in %llu ns, the reset in %llu ns\n", gpionum[g],
+                    (unsigned long long)stats.fast_starts, (unsigned long long)stats.starts,
+                    (unsigned long long)fast_latency, (unsigned long long)reset_latency);
+            ret = -1;
+        }
+
+        ws2811_fini(&ws2811);
+    }
+
+    return ret;
+}
+
+/**
+ * Check whether a descriptor is readable, waiting at most timeout ms.
+ *
+ * @param    fd       Descriptor.
+ * @param    timeout  Time to wait in ms, 0 to only look.
+ *
+ * @returns  1 if readable, 0 if not, -1 on error.
+ */
+static int verify_readable(int fd, int timeout)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    return poll(&pfd, 1, timeout);
+}
+
+/**
+ * Check that the LEDs of a memory output show one value each, the frame number.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    frame   Frame number expected.
+ *
+ * @returns  0 if the last frame captured is that frame, -1 otherwise.
+ */
+static int verify_mem_frame(ws2811_t *ws2811, int frame)
+{
+    ws2811_led_t decoded[VERIFY_LEDS];
+    decode_error_t error;
+    const uint8_t *data;
+    size_t len;
+    int count, i;
+
+    data = ws2811_get_mem_frame(ws2811, &len);
+    count = ws2811_decode_frame(ws2811, data, len, 0, decoded, &error);
+    for (i = 0; (i < count) && (decoded[i] == (ws2811_led_t)frame); i++)
+        ;
+
+    if ((count != ws2811->channel[0].count) || (i != count))
+    {
+        fprintf(stderr, "async: %d LEDs decoded, LED %d shows %08x, expected frame %d\n",
+                count, i, (i < count) ? decoded[i] : 0, frame);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Render asynchronously on a memory output.  The completion descriptor must stay quiet until
+ * the frame and the reset time after it are over and become readable then, and a frame queued
+ * behind one still going out must be replaced by the next one queued instead of being sent.
+ *
+ * @returns  0 if the asynchronous API behaves, -1 otherwise.
+ */
+static int verify_async(void)
+{
+    ws2811_t ws2811 =
+    {
+        .freq = TARGET_FREQ,
+        .dmanum = DMA,
+    };
+    ws2811_channel_t *channel = &ws2811.channel[0];
+    ws2811_stats_t stats;
+    uint64_t start, ready;
+    int fd, readable, frame, i, ret = -1;
+
+    channel->gpionum = GPIO_PIN;
+    channel->count = VERIFY_LEDS;
+    channel->brightness = 255;
+    channel->strip_type = WS2811_STRIP_GRB;
+
+    if (ws2811_mem_init(&ws2811) != WS2811_SUCCESS)
+    {
+        return -1;
+    }
+
+    if ((fd = ws2811_get_async_fd(&ws2811)) < 0)
+    {
+        goto out;
+    }
+
+    // One frame on an idle output goes out right away
+    for (i = 0; i < channel->count; i++)
+    {
+        channel->leds[i] = 1;
+    }
+    start = monotonic_ns();
+    if (ws2811_render_async(&ws2811) != WS2811_SUCCESS)
+    {
+        goto out;
+    }
+    ready = ws2811_get_ready_time(&ws2811);
+
+    if ((ready < start + ws2811.render_wait_time * 1000) ||
+        (ws2811.render_wait_time <= ws2811_get_frame_time(&ws2811)))
+    {
+        fprintf(stderr, "async: ready %llu ns after the render, frame and reset take %llu us\n",
+                (unsigned long long)(ready - start), (unsigned long long)ws2811.render_wait_time);
+        goto out;
+    }
+
+    // Quiet until the frame is over, readable then.  The clock is read after every look, a
+    // descriptor readable while it is still short of ready went off early
+    for (readable = 0; !readable; usleep(100))
+    {
+        if ((readable = verify_readable(fd, 0)) < 0)
+        {
+            goto out;
+        }
+        if (readable && (monotonic_ns() < ready))
+        {
+            fprintf(stderr, "async: readable %llu ns before the frame is over\n",
+                    (unsigned long long)(ready - monotonic_ns()));
+            goto out;
+        }
+        if (!readable && (monotonic_ns() > ready + 1000000000))
+        {
+            fprintf(stderr, "async: not readable once the frame is over\n");
+            goto out;
+        }
+    }
+    if ((ws2811_async_complete(&ws2811) != WS2811_SUCCESS) || ws2811_async_busy(&ws2811) ||
+        verify_mem_frame(&ws2811, 1))
+    {
+        goto out;
+    }
+
+    // Queue 3 behind 2, then 4, which must take the place of 3
+    ws2811_reset_stats(&ws2811);
+    for (frame = 2; frame <= 4; frame++)
+    {
+        for (i = 0; i < channel->count; i++)
+        {
+            channel->leds[i] = frame;
+        }
+        if (ws2811_render_async(&ws2811) != WS2811_SUCCESS)
+        {
+            goto out;
+        }
+        if (frame == 2)
+        {
+            ready = ws2811_get_ready_time(&ws2811);
+        }
+    }
+
+    while (ws2811_async_busy(&ws2811))
+    {
+        if ((verify_readable(fd, 1000) != 1) || (ws2811_async_complete(&ws2811) != WS2811_SUCCESS))
+        {
+            fprintf(stderr, "async: queued frame never completed\n");
+            goto out;
+        }
+    }
+
+    // 4 went out after 2 was over, and 3 not at all
+    ws2811_get_stats(&ws2811, &stats);
+    if ((stats.starts != 2) ||
+        (ws2811_get_ready_time(&ws2811) < ready + ws2811.render_wait_time * 1000))
+    {
+        fprintf(stderr, "async: %llu frames sent for 2, the last ready %lld ns after the first\n",
+                (unsigned long long)stats.starts,
+                (long long)(ws2811_get_ready_time(&ws2811) - ready));
+        goto out;
+    }
+
+    ret = verify_mem_frame(&ws2811, 4);
+
+out:
+    ws2811_fini(&ws2811);
+
+    return ret;
+}
+
+/**
+ * Split a canvas across a PWM instance with both channels, a PCM and an SPI instance, two of
+ * the segments reversed, and decode what every output sent.  Every frame must take the wire
+ * time of the longest segment before canvas_wait() returns.
+ *
+ * @returns  0 if every channel shows its slice of the canvas, -1 otherwise.
+ */
+static int verify_canvas(void)
+{
+    static const struct
+    {
+        int output;
+        int gpionum;
+        int count;
+        int reverse;
+    } slices[] =
+    {
+        { 0, 18, 40, 0 },
+        { 0, 13, 30, 1 },
+        { 2, 10, 20, 0 },
+        { 1, 21, 50, 1 },
+    };
+    ws2811_t outputs[3];
+    ws2811_led_t decoded[VERIFY_LEDS];
+    canvas_t canvas = { 0 };
+    uint32_t seed = VERIFY_SEED;
+    uint32_t longest_us = 0;
+    int initialized, frame, i, j, ret = 0;
+
+    memset(outputs, 0, sizeof(outputs));
+    for (i = 0; i < (int)ARRAY_SIZE(slices); i++)
+    {
+        ws2811_t *ws2811 = &outputs[slices[i].output];
+        ws2811_channel_t *channel = &ws2811->channel[(slices[i].gpionum == 13) ? 1 : 0];
+        canvas_segment_t *segment = &canvas.segment[i];
+
+        ws2811->freq = TARGET_FREQ;
+        ws2811->dmanum = DMA - slices[i].output;
+        channel->gpionum = slices[i].gpionum;
+        channel->count = slices[i].count;
+        channel->brightness = 255;
+        channel->strip_type = WS2811_STRIP_GRB;
+
+        segment->ws2811 = ws2811;
+        segment->channel = channel - ws2811->channel;
+        segment->start = canvas.count;
+        segment->count = slices[i].count;
+        segment->reverse = slices[i].reverse;
+        canvas.count += slices[i].count;
+
+        // 3 colours of 8 bits, 1.25µs each
+        if ((uint32_t)slices[i].count * 30 > longest_us)
+        {
+            longest_us = slices[i].count * 30;
+        }
+    }
+    canvas.segment_count = ARRAY_SIZE(slices);
+
+    for (initialized = 0; initialized < (int)ARRAY_SIZE(outputs); initialized++)
+    {
+        if (ws2811_mem_init(&outputs[initialized]) != WS2811_SUCCESS)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (!ret && (canvas_init(&canvas) != WS2811_SUCCESS))
+    {
+        ret = -1;
+    }
+
+    // SPI blocks while it sends, so it must be started last
+    if (!ret && (canvas.outputs[canvas.output_count - 1] != &outputs[2]))
+    {
+        fprintf(stderr, "canvas: SPI output is not started last\n");
+        ret = -1;
+    }
+
+    if (!ret && (canvas_get_frame_time(&canvas) < longest_us))
+    {
+        fprintf(stderr, "canvas: frame time %u us, the longest segment takes %u us\n",
+                canvas_get_frame_time(&canvas), longest_us);
+        ret = -1;
+    }
+
+    for (frame = 0; (frame < VERIFY_CANVAS_FRAMES) && !ret; frame++)
+    {
+        uint64_t start;
+
+        // Every LED changes, so every output sends its whole segment
+        for (i = 0; i < canvas.count; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            canvas.leds[i] = ((seed >> 8) & 0xff00ff) | (frame << 8);
+        }
+
+        start = monotonic_ns();
+        if ((canvas_render(&canvas) != WS2811_SUCCESS) || (canvas_wait(&canvas) != WS2811_SUCCESS))
+        {
+            ret = -1;
+            break;
+        }
+
+        // The outputs send at the same time, so together they take as long as the longest
+        if (monotonic_ns() - start < (uint64_t)longest_us * 1000)
+        {
+            fprintf(stderr, "canvas frame %d: sent in %llu ns, the longest segment takes %u us\n",
+                    frame, (unsigned long long)(monotonic_ns() - start), longest_us);
+            ret = -1;
+            break;
+        }
+
+        for (i = 0; (i < canvas.segment_count) && !ret; i++)
+        {
+            canvas_segment_t *segment = &canvas.segment[i];
+            const uint8_t *data;
+            decode_error_t error;
+            size_t len;
+            int count;
+
+            data = ws2811_get_mem_frame(segment->ws2811, &len);
+            count = ws2811_decode_frame(segment->ws2811, data, len, segment->channel, decoded,
+                                        &error);
+            if (count != segment->count)
+            {
+                fprintf(stderr, "canvas frame %d segment %d: decoded %d LEDs, expected %d\n",
+                        frame, i, count, segment->count);
+                ret = -1;
+                break;
+            }
+
+            for (j = 0; j < count; j++)
+            {
+                int led = segment->start + (segment->reverse ? count - 1 - j : j);
+
+                if (decoded[j] != canvas.leds[led])
+                {
+                    fprintf(stderr, "canvas frame %d segment %d: LED %d shows %08x, expected %08x\n",
+                            frame, i, j, decoded[j], canvas.leds[led]);
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+    }
+
+    canvas_fini(&canvas);
+    for (i = 0; i < initialized; i++)
+    {
+        ws2811_fini(&outputs[i]);
+    }
+
+    return ret;
+}
+
+/**
+ * Step frame clocks of both overrun policies through synthetic times, on time, early, a few
+ * deadlines late and far more than can be caught up, and check every tick count, deadline and
+ * counter on the way.
+ *
+ * @returns  0 if the clocks keep to the schedule, -1 otherwise.
+ */
+static int verify_frame_clock(void)
+{
+    // Times in quarters of a period after the first tick
+    static const struct
+    {
+        overrun_policy_t policy;
+        uint64_t now;
+        int due;
+        uint64_t next;
+        uint64_t ticks;
+        uint64_t late;
+        uint64_t skipped;
+        uint64_t max_late;
+    } steps[] =
+    {
+        { OVERRUN_SKIP, 0, 1, 4, 1, 0, 0, 0 },
+        { OVERRUN_SKIP, 2, 0, 4, 1, 0, 0, 0 },
+        { OVERRUN_SKIP, 4, 1, 8, 2, 0, 0, 0 },
+        { OVERRUN_SKIP, 22, 1, 24, 3, 1, 3, 14 },           // 3.5 periods late
+        { OVERRUN_SKIP, 24, 1, 28, 4, 1, 3, 14 },
+        { OVERRUN_CATCH_UP, 0, 1, 4, 1, 0, 0, 0 },
+        { OVERRUN_CATCH_UP, 13, 3, 16, 4, 1, 0, 9 },        // 2.25 periods late
+        { OVERRUN_CATCH_UP, 176, FRAME_CLOCK_CATCH_UP_MAX, 180, 36, 2, 9, 160 },  // 40 periods
+    };
+    const uint64_t quarter = 2500000, start = 1000000000;
+    frame_clock_t clock;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(steps); i++)
+    {
+        int due;
+
+        if (!i || (steps[i].policy != steps[i - 1].policy))
+        {
+            memset(&clock, 0, sizeof(clock));
+            clock.period_ns = 4 * quarter;
+            clock.policy = steps[i].policy;
+        }
+
+        due = frame_clock_due(&clock, start + steps[i].now * quarter);
+        if ((due != steps[i].due) || (clock.next_ns != start + steps[i].next * quarter) ||
+            (clock.ticks != steps[i].ticks) || (clock.late != steps[i].late) ||
+            (clock.skipped != steps[i].skipped) ||
+            (clock.max_late_ns != steps[i].max_late * quarter))
+        {
+            fprintf(stderr, "frame clock step %zu: %d ticks due, next at %llu, %llu ticks, "
+                    "%llu late, %llu skipped, %llu ns worst\n", i, due,
+                    (unsigned long long)((clock.next_ns - start) / quarter),
+                    (unsigned long long)clock.ticks, (unsigned long long)clock.late,
+                    (unsigned long long)clock.skipped, (unsigned long long)clock.max_late_ns);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Tick of the patterns verify_scheduler() runs, counts its ticks in its first LED.
+ *
+ * @param    pattern  Pattern.
+ *
+ * @returns  WS2811_SUCCESS
+ */
+static ws2811_return_t verify_tick(struct pattern *pattern)
+{
+    pattern->ledstring.channel[0].leds[0]++;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Blend two layers of known LEDs in every blend mode and compare with the result worked out
+ * by hand, then tick two patterns at the same rate and check they share every frame.
+ *
+ * @returns  0 if every blend and the frame count are right, -1 otherwise.
+ */
+static int verify_scheduler(void)
+{
+    static const ws2811_led_t below[] = { 0x00000000, 0x00102030, 0x00ff8000, 0x00808080 };
+    static const ws2811_led_t above[] = { 0x00405060, 0x00000000, 0x00ff8040, 0x00404040 };
+    static const struct
+    {
+        blend_mode_t blend;
+        const char *name;
+        ws2811_led_t expected[ARRAY_SIZE(below)];
+    } blends[] =
+    {
+        { BLEND_REPLACE, "replace", { 0x00405060, 0x00000000, 0x00ff8040, 0x00404040 } },
+        { BLEND_OVER, "over", { 0x00405060, 0x00102030, 0x00ff8040, 0x00404040 } },
+        { BLEND_ADD, "add", { 0x00405060, 0x00102030, 0x00ffff40, 0x00c0c0c0 } },
+        { BLEND_MAX, "max", { 0x00405060, 0x00102030, 0x00ff8040, 0x00808080 } },
+        { BLEND_MULTIPLY, "multiply", { 0x00000000, 0x00000000, 0x00ff4000, 0x00202020 } },
+    };
+    ws2811_t ws2811 =
+    {
+        .freq = TARGET_FREQ,
+        .dmanum = DMA,
+        .channel =
+        {
+            [0] =
+            {
+                .gpionum = GPIO_PIN,
+                .count = ARRAY_SIZE(below),
+                .brightness = 255,
+                .strip_type = STRIP_TYPE,
+            },
+        },
+    };
+    struct pattern patterns[2];
+    scheduler_t scheduler;
+    ws2811_stats_t stats;
+    size_t b, i;
+    int ret = 0;
+
+    if (ws2811_mem_init(&ws2811) != WS2811_SUCCESS)
+    {
+        return -1;
+    }
+
+    memset(patterns, 0, sizeof(patterns));
+    for (i = 0; i < ARRAY_SIZE(patterns); i++)
+    {
+        patterns[i].movement_rate = VERIFY_TICK_RATE;
+        patterns[i].running = true;
+        patterns[i].func_tick = verify_tick;
+    }
+
+    for (b = 0; (b < ARRAY_SIZE(blends)) && !ret; b++)
+    {
+        if ((scheduler_init(&scheduler, &ws2811) != WS2811_SUCCESS) ||
+            (scheduler_add(&scheduler, &patterns[0], BLEND_REPLACE) != WS2811_SUCCESS) ||
+            (scheduler_add(&scheduler, &patterns[1], blends[b].blend) != WS2811_SUCCESS))
+        {
+            ret = -1;
+            break;
+        }
+
+        memcpy(patterns[0].ledstring.channel[0].leds, below, sizeof(below));
+        memcpy(patterns[1].ledstring.channel[0].leds, above, sizeof(above));
+        if (scheduler_render(&scheduler) != WS2811_SUCCESS)
+        {
+            ret = -1;
+        }
+
+        for (i = 0; (i < ARRAY_SIZE(below)) && !ret; i++)
+        {
+            if (ws2811.channel[0].leds[i] != blends[b].expected[i])
+            {
+                fprintf(stderr, "blend %s: %08x over %08x gives %08x, expected %08x\n",
+                        blends[b].name, above[i], below[i], ws2811.channel[0].leds[i],
+                        blends[b].expected[i]);
+                ret = -1;
+            }
+        }
+
+        scheduler_fini(&scheduler);
+    }
+
+    // Patterns on the same schedule are ticked together and rendered once
+    if (!ret && ((scheduler_init(&scheduler, &ws2811) != WS2811_SUCCESS) ||
+                 (scheduler_add(&scheduler, &patterns[0], BLEND_REPLACE) != WS2811_SUCCESS) ||
+                 (scheduler_add(&scheduler, &patterns[1], BLEND_ADD) != WS2811_SUCCESS)))
+    {
+        ret = -1;
+    }
+    if (!ret)
+    {
+        patterns[0].ledstring.channel[0].leds[0] = 0;
+        patterns[1].ledstring.channel[0].leds[0] = 0;
+        ws2811_reset_stats(&ws2811);
+
+        if (scheduler_start(&scheduler) != WS2811_SUCCESS)
+        {
+            ret = -1;
+        }
+        usleep(VERIFY_TICK_TIME_US);
+        scheduler_stop(&scheduler);
+        ws2811_get_stats(&ws2811, &stats);
+
+        if (!scheduler.frames ||
+            (patterns[0].ledstring.channel[0].leds[0] != scheduler.frames) ||
+            (patterns[1].ledstring.channel[0].leds[0] != scheduler.frames) ||
+            (scheduler.ticks != 2 * scheduler.frames) ||
+            (stats.frames + stats.frames_skipped != scheduler.frames))
+        {
+            fprintf(stderr, "scheduler: %llu and %u ticks in %llu frames, %llu renders\n",
+                    (unsigned long long)patterns[0].ledstring.channel[0].leds[0],
+                    patterns[1].ledstring.channel[0].leds[0],
+                    (unsigned long long)scheduler.frames,
+                    (unsigned long long)(stats.frames + stats.frames_skipped));
+            ret = -1;
+        }
+
+        scheduler_fini(&scheduler);
+    }
+
+    ws2811_fini(&ws2811);
+
+    return ret;
+}
+
+/* One of the threads verify_inject() pushes events from */
+typedef struct
+{
+    pthread_t thread;
+    inject_queue_t *queue;
+    uint32_t index;
+    uint64_t dropped;
+    int *finished;
+} verify_producer_t;
+
+/**
+ * Push events numbered in order, each with an intensity derived from its colour so a torn
+ * event shows.  Pauses after every burst so the consumer gets to drain in between.
+ *
+ * @param    arg  verify_producer_t of the thread.
+ *
+ * @returns  NULL
+ */
+static void *verify_producer(void *arg)
+{
+    verify_producer_t *producer = arg;
+    uint32_t i;
+
+    for (i = 0; i < VERIFY_PRODUCER_EVENTS; i++)
+    {
+        ws2811_led_t color = (producer->index << 20) | i;
+
+        if (inject_queue_push(producer->queue, color, color * 2654435761U))
+        {
+            producer->dropped++;
+        }
+        if (!((i + 1) % VERIFY_PRODUCER_BURST))
+        {
+            usleep(50);
+        }
+    }
+    __atomic_add_fetch(producer->finished, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/**
+ * Push from several threads at once, far more than the queue holds between two drains, while
+ * one thread drains.  Every event must come out whole and at most once, each producer's
+ * events in the order it pushed them, and the counters must account for all of them.
+ *
+ * @returns  0 if the queue loses nothing it did not count, -1 otherwise.
+ */
+static int verify_inject(void)
+{
+    static inject_queue_t queue;
+    verify_producer_t producer[VERIFY_PRODUCERS];
+    inject_event_t events[INJECT_QUEUE_SIZE];
+    int32_t last[VERIFY_PRODUCERS];
+    uint64_t drained = 0, dropped = 0, drains = 0;
+    int started, finished = 0, done, i, ret = 0;
+
+    inject_queue_init(&queue);
+
+    for (started = 0; started < VERIFY_PRODUCERS; started++)
+    {
+        producer[started].queue = &queue;
+        producer[started].index = started;
+        producer[started].dropped = 0;
+        producer[started].finished = &finished;
+        last[started] = -1;
+        if (pthread_create(&producer[started].thread, NULL, verify_producer, &producer[started]))
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    // Drain until the producers are done and nothing is left
+    for (done = 0; done < 2; )
+    {
+        int count = inject_queue_drain(&queue, events, INJECT_QUEUE_SIZE);
+
+        for (i = 0; i < count; i++)
+        {
+            uint32_t index = events[i].color >> 20;
+            int32_t seq = events[i].color & 0xfffff;
+
+            if ((index >= (uint32_t)started) ||
+                (events[i].intensity != events[i].color * 2654435761U) || !events[i].time_ns ||
+                (seq <= last[index]))
+            {
+                fprintf(stderr, "inject: event %08x intensity %08x after %d of producer %u\n",
+                        events[i].color, events[i].intensity,
+                        (index < (uint32_t)started) ? last[index] : -1, index);
+                ret = -1;
+                break;
+            }
+            last[index] = seq;
+        }
+        drained += count;
+        drains += (count > 0);
+
+        if (!count && (done || (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) == started)))
+        {
+            done++;
+        }
+        usleep(200);
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(producer[i].thread, NULL);
+        dropped += producer[i].dropped;
+    }
+
+    if (!ret && ((queue.pushed != drained) || (queue.dropped != dropped) ||
+                 (drained + dropped != (uint64_t)started * VERIFY_PRODUCER_EVENTS) ||
+                 !dropped || (drained <= INJECT_QUEUE_SIZE)))
+    {
+        fprintf(stderr, "inject: %llu pushed, %llu drained in %llu batches, %llu dropped, "
+                "producers dropped %llu\n", (unsigned long long)queue.pushed,
+                (unsigned long long)drained, (unsigned long long)drains,
+                (unsigned long long)queue.dropped, (unsigned long long)dropped);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * Check every encoder kernel the CPU supports against the table encoder, then the frames of
+ * every output layout against what was rendered, then everything else in checks.
+ *
+ * @returns  0 if everything matches, -1 otherwise.
+ */
+static int verify(void)
+{
+    static const struct
+    {
+        const char *name;
+        int (*check)(void);
+    } checks[] =
+    {
+        { "canvas", verify_canvas },
+        { "threads", verify_threads },
+        { "sim", verify_sim },
+        { "timed sim", verify_timed_sim },
+        { "async", verify_async },
+        { "frame clock", verify_frame_clock },
+        { "scheduler", verify_scheduler },
+        { "inject", verify_inject },
+    };
+    static const struct
+    {
+        const char *name;
+        int gpionum;
+    } layouts[] =
+    {
+        { "pwm", 18 },
+        { "pcm", 21 },
+        { "spi", 10 },
+    };
+    const encode_kernel_desc_t *desc;
+    int ret = 0;
+    size_t i;
+    int rgbw, invert;
+
+    for (desc = encode_kernels; desc->name; desc++)
+    {
+        if (desc->supported && !desc->supported())
+        {
+            printf("kernel %-8s not supported\n", desc->name);
+            continue;
+        }
+
+        if (encode_verify_random(desc, VERIFY_SEED, VERIFY_ROUNDS))
+        {
+            printf("kernel %-8s FAILED\n", desc->name);
+            ret = -1;
+        }
+        else
+        {
+            printf("kernel %-8s ok\n", desc->name);
+        }
+    }
+
+    for (i = 0; i < ARRAY_SIZE(layouts); i++)
+    {
+        for (rgbw = 0; rgbw < 2; rgbw++)
+        {
+            for (invert = 0; invert < 2; invert++)
+            {
+                int strip = rgbw ? SK6812_STRIP_GRBW : WS2811_STRIP_GRB;
+                int fail = verify_frames(layouts[i].gpionum, strip, invert, VERIFY_SEED + i);
+
+                printf("frames %s %s%s %s\n", layouts[i].name, rgbw ? "rgbw" : "rgb",
+                       invert ? " inverted" : "", fail ? "FAILED" : "ok");
+                if (fail)
+                {
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < ARRAY_SIZE(checks); i++)
+    {
+        int fail = checks[i].check();
+
+        printf("%s %s\n", checks[i].name, fail ? "FAILED" : "ok");
+        if (fail)
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
 
 void parseargs(int argc, char **argv, ws2811_t *ws2811)
 {
@@ -149,6 +1426,8 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
         {"maintain_color", required_argument, 0, 'M'},
         {"sleep_rate", required_argument, 0, 'S'},
         {"pulse_width", required_argument, 0, 'P'},
+        {"verify", no_argument, 0, 'V'},
+        {"layout", required_argument, 0, 'L'},
         {0, 0, 0, 0}
 	};
 
@@ -156,7 +1435,7 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 	{
 
 		index = 0;
-		c = getopt_long(argc, argv, "cd:g:his:vx:y:p:m:S:M:P:", longopts, &index);
+		c = getopt_long(argc, argv, "cd:g:his:vVx:y:p:m:S:M:P:L:", longopts, &index);
 
 		if (c == -1)
 			break;
@@ -174,6 +1453,7 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 				"-s (--strip)   - strip type - rgb, grb, gbr, rgbw\n"
 				"-x (--width)   - matrix width (default 8)\n"
 				"-y (--height)  - matrix height (default 8)\n"
+				"-L (--layout)  - file mapping the matrix onto the strip (default Unicorn-HAT)\n"
 				"-d (--dma)     - dma channel to use (default 5)\n"
 				"-g (--gpio)    - GPIO to use\n"
 				"                 If omitted, default is 18 (PWM0)\n"
@@ -185,6 +1465,7 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
                 "-S (--sleep_rate)     - The number of seconds to sleep between commands\n"
                 "###-M### (--maintain_color) - Goes nowhere, does nothing\n"
                 "-P (--pulse_width)    - The number of LEDs x2 per pulse\n"
+                "-V (--verify)  - check the encoders and decode the output of every layout, no hardware needed\n"
 				, argv[0]);
 			exit(-1);
 
@@ -249,6 +1530,9 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
             if (optarg) {
                 pulse_width = atoi(optarg);
             }
+            break;
+        case 'L':
+            layout_file = optarg;
             break;
 		case 'y':
 			if (optarg) {
@@ -316,6 +1600,9 @@ void parseargs(int argc, char **argv, ws2811_t *ws2811)
 			fprintf(stderr, "%s version %s\n", argv[0], VERSION);
 			exit(-1);
 
+        case 'V':
+            exit(verify() ? 1 : 0);
+
 		case '?':
 			/* getopt_long already reported error? */
 			exit(-1);
@@ -366,15 +1653,27 @@ int main(int argc, char *argv[])
     pattern->height = height;
     pattern->led_count = led_count;
     pattern->clear_on_exit = clear_on_exit;
-    pattern->ledstring = ledstring;
     pattern->maintainColor = maintain_colors;
     pattern->movement_rate = movement_rate;
     pattern->pulseWidth = pulse_width;
+    pattern->layout_file = layout_file;
+
+    /* The scheduler owns the string, the pattern draws into a layer of it */
+    if ((ret = scheduler_init(&scheduler, &ledstring)) != WS2811_SUCCESS ||
+        (ret = scheduler_add(&scheduler, pattern, BLEND_REPLACE)) != WS2811_SUCCESS) {
+        log_fatal("scheduler setup failed: %s", ws2811_get_return_t_str(ret));
+        return ret;
+    }
+
     /* Load the program into memory */
-    pattern->func_load_pattern(pattern);
+    if ((ret = pattern->func_load_pattern(pattern)) != WS2811_SUCCESS) {
+        log_fatal("pattern load failed: %s", ws2811_get_return_t_str(ret));
+        return ret;
+    }
 
     /* Start the program */
     pattern->func_start_pattern(pattern);
+    scheduler_start(&scheduler);
 
     /* We halt until control+c is provided */
     if (program == 0) {
@@ -387,17 +1686,32 @@ int main(int argc, char *argv[])
         bool random = false;
         while (running) {
             if (random) {
-                pattern->func_inject(colors[rand() % colors_size], rand()%100);
+                pattern->func_inject(pattern, colors[rand() % colors_size], rand()%100);
                 usleep(sleep_rate);
             }
             else {
-                pattern->func_inject(colors[i], rand()%100);
+                pattern->func_inject(pattern, colors[i], rand()%100);
                 usleep(sleep_rate);
                 i = (i == colors_size-1) ? 0 : (i + 1);    
             }
         }
     }
 
+    /* Stop ticking, let the pattern clean up its layer and send that */
+    scheduler_stop(&scheduler);
+    log_info("Ticks %llu, late %llu, skipped %llu, worst lateness %llu us",
+             (unsigned long long)scheduler.layer[0].clock.ticks,
+             (unsigned long long)scheduler.layer[0].clock.late,
+             (unsigned long long)scheduler.layer[0].clock.skipped,
+             (unsigned long long)scheduler.layer[0].clock.max_late_ns / 1000);
+    if (program == 1) {
+        log_info("Injected %llu, dropped %llu", (unsigned long long)pattern->inject.pushed,
+                 (unsigned long long)pattern->inject.dropped);
+    }
+    pattern->func_kill_pattern(pattern);
+    scheduler_render(&scheduler);
+    scheduler_fini(&scheduler);
+
     /* Clear the program from memory */
     ws2811_fini(&ledstring);
 
@@ -6,7 +6,9 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
-#include <pthread.h>
+
+#include "layout.h"
+#include "inject.h"
 
 #define COLOR_RED         0x00FF0000
 #define COLOR_ORANGE      0x00FF8000
@@ -30,6 +32,8 @@ static const ws2811_led_t colors[] =
 
 static const uint32_t colors_size = 8;
 
+struct pulse_state;
+
 /* The basic structure for all patterns */
 struct pattern
 {
@@ -51,13 +55,16 @@ struct pattern
     bool maintainColor;
     /* The width of each pulse */
     uint32_t pulseWidth;
-    /* The thread id of the running loop */
-    pthread_t thread_id;
-
-    /* The actual led string */
+    /* The layer the pattern draws into, set up by scheduler_add() */
     ws2811_t ledstring;
-    /* The 2-dimensional representation of what lights are what color */
-    ws2811_led_t *matrix;
+    /* File with the matrix layout, NULL for the Unicorn-HAT - XXX: Rainbow Specific */
+    const char *layout_file;
+    /* Where each LED of the 2-dimensional matrix is on the string */
+    layout_t layout;
+    /* Colors injected, drained by the pattern on every tick - XXX: Pulse Specific */
+    inject_queue_t inject;
+    /* The pulse being drawn, one per pattern so layers don't share it - XXX: Pulse Specific */
+    struct pulse_state *pulse;
     
     /* Load a given pattern and start its threaded loop */
     ws2811_return_t (*func_load_pattern)(struct pattern *pattern);
@@ -65,26 +72,43 @@ struct pattern
     ws2811_return_t (*func_start_pattern)(struct pattern *pattern);
     /* Pause or resume a given pattern, based upon argument "pause" */
     ws2811_return_t (*func_pause_pattern)(struct pattern *pattern);
+    /* Draw the next frame, the scheduler calls it at the movement rate */
+    ws2811_return_t (*func_tick)(struct pattern *pattern);
     /* Kill whatever pattern is running */
     ws2811_return_t (*func_kill_pattern)(struct pattern *pattern);
     /* Free pattern form memory */
     ws2811_return_t (*func_delete)(struct pattern *pattern);
     /* XXX: This should only apply to pattern_pulse */
-    ws2811_return_t (*func_inject)(ws2811_led_t color, uint32_t intensity);
+    ws2811_return_t (*func_inject)(struct pattern *pattern, ws2811_led_t color, uint32_t intensity);
 };
 
 
-/* This only shifts forward one */
-inline void
+/* LED at position i of the strip, the LED array of the channel is a ring.  Only for strings
+ * with LEDs, the patterns refuse to load on an empty one. */
+static inline ws2811_led_t *
+strip_led(struct pattern *pattern, uint32_t i)
+{
+    ws2811_channel_t *channel = &pattern->ledstring.channel[0];
+
+    return &channel->leds[(i + channel->offset) % channel->count];
+}
+
+/* Shift the whole strip forward by turning the ring, only the LEDs shifted in at the start are
+ * written.  What falls off the end wraps around to the start, so those are cleared. */
+static inline void
 move_lights(struct pattern *pattern, uint32_t shift_distance)
 {
-    ws2811_led_t *led_array = pattern->ledstring.channel[0].leds;
+    ws2811_channel_t *channel = &pattern->ledstring.channel[0];
+    uint32_t i;
+
+    if (!channel->count) {
+        return;
+    }
 
-    // Shift everything in ledstring exactly one led forward
-    int i = pattern->led_count - shift_distance;
-    while (i > 0) {
-        memmove(&led_array[i], &led_array[i-shift_distance], sizeof(ws2811_led_t));
-        i--;
+    shift_distance %= channel->count;
+    channel->offset = (channel->offset + channel->count - shift_distance) % channel->count;
+    for (i = 0; i < shift_distance; i++) {
+        *strip_led(pattern, i) = 0;
     }
 }
 
@@ -53,140 +53,184 @@
 #include "pattern_pulse.h"
 #include "log.h"
 
-static ws2811_led_t color = 0;
-static bool newColor = false;
-static uint32_t intensity = 0;
+/* State of the pulse being drawn, kept between ticks */
+struct pulse_state
+{
+    ws2811_led_t color;
+    uint32_t intensity;
+    int step;
+    bool rampUp;
+    bool colorFinished;
+    double prev_amp;
+    uint32_t r_shift;
+    uint32_t g_shift;
+    uint32_t b_shift;
+    double slope;
+    uint32_t pulseWidth;
+    uint32_t maxStripBrightness;
+};
 
-/* A new color has been injected. What happens to old color? */
+/* A new color has been injected, it is drawn from the next tick on. Never blocks, a full
+ * queue drops the color and counts it. Colors injected between two ticks are not kept
+ * apart: they start one pulse together, their colors summed and clipped at full, with the
+ * highest of their intensities, see pulse_collect() */
 ws2811_return_t
-pulse_inject(ws2811_led_t in_color, uint32_t in_intensity)
+pulse_inject(struct pattern *pattern, ws2811_led_t in_color, uint32_t in_intensity)
 {
     log_trace("pulse_inject(): %d, %d\n", in_color, in_intensity);
     ws2811_return_t ret = WS2811_SUCCESS;
-    color = in_color;
-    newColor = true;
-    intensity = in_intensity;
+    if (inject_queue_push(&pattern->inject, in_color, in_intensity)) {
+        ret = WS2811_ERROR_GENERIC;
+    }
     return ret;
 }
 
-/* Run the threaded loop */
-void *
-matrix_run2(void *vargp)
+/* Colors injected since the last tick make up one pulse, the colors add up and the highest
+ * intensity wins. Returns whether there were any */
+static bool
+pulse_collect(struct pattern *pattern)
 {
-    log_matrix_trace("pulse_run()");
+    struct pulse_state *state = pattern->pulse;
+    inject_event_t events[INJECT_QUEUE_SIZE];
+    int count = inject_queue_drain(&pattern->inject, events, INJECT_QUEUE_SIZE);
+    uint64_t first, last;
+    int i, shift;
 
-    ws2811_return_t ret = WS2811_SUCCESS;
-    struct pattern *pattern = (struct pattern*)vargp;
-    assert(pattern->running);
-    pattern->ledstring.channel[0].brightness = 255;
-    int i = 0;
-    bool rampUp = true;
-    bool colorFinished = true;
-    newColor = false;
-    double prev_amp = 0;
-    uint32_t r_shift;
-    uint32_t g_shift;
-    uint32_t b_shift;
+    if (!count) {
+        return false;
+    }
+
+    state->color = 0;
+    state->intensity = 0;
+    /* Producers stamp their events in whatever order they run, not queue order */
+    first = last = events[0].time_ns;
+    for (i = 0; i < count; i++) {
+        for (shift = 0; shift < 24; shift += 8) {
+            uint32_t sum = ((state->color >> shift) & 0xff) + ((events[i].color >> shift) & 0xff);
+            state->color = (state->color & ~(0xffu << shift)) |
+                           (((sum > 0xff) ? 0xff : sum) << shift);
+        }
+        if (events[i].intensity > state->intensity) {
+            state->intensity = events[i].intensity;
+        }
+        if (events[i].time_ns < first) {
+            first = events[i].time_ns;
+        }
+        if (events[i].time_ns > last) {
+            last = events[i].time_ns;
+        }
+    }
+    log_matrix_trace("Collected %d injections over %llu ns", count,
+                     (unsigned long long)(last - first));
+    return true;
+}
+
+/* Draw the next frame, called by the scheduler */
+ws2811_return_t
+pulse_tick(struct pattern *pattern)
+{
+    log_matrix_trace("pulse_tick()");
+
+    struct pulse_state *state = pattern->pulse;
     uint32_t red, green, blue;
     double scalar;
-    double slope;
-    uint32_t pulseWidth;
-    uint32_t maxStripBrightness;
-    while (pattern->running)
-    {
-        if (!pattern->paused) {
-            move_lights(pattern, 1);
-            /* Set up boundary conditions of a single pulse */
-            if (newColor) {
-                // get prev_amp of previous pattern, which if the other ended, it should be zero
-                r_shift = (color & 0xFF0000) >> 16;
-                g_shift = (color & 0x00FF00) >> 8;
-                b_shift = (color & 0x0000FF);
-                colorFinished = true;
-
-                log_matrix_trace("Injecting");
-                //prev_amp = 0;
-                i = 0;
-                newColor = false;
-                rampUp = true;
-                colorFinished = false;
-                
-                if (pattern->pulseWidth == 0) {
-                    pulseWidth = intensity / 5;
-                }
-                else {
-                    pulseWidth = pattern->pulseWidth;
-                }
-                
-                if (pulseWidth <= 1) {
-		            pulseWidth = 2;
-		        }
-                /* Calculate the slope at wherever the CURRENT led's brightness is
-                 * to the maximum brightness. This could be interupting a different pulse,
-                 * we ramp up from where we are */
-                /* Start with the maximum desired brightness */
-                // XXX rename me
-                maxStripBrightness = pattern->ledstring.channel[0].brightness;
-                /* Divide maximum brightness by the width of the pulse */
-                slope = (double)(((double)(maxStripBrightness-(prev_amp*256))/(double)pulseWidth) / 256);
-                /* Multiply by the intensity */
-                slope = slope * (double)((double)intensity/(double)100);
-                printf("Slope: %lf Prev_Amp: %lf Total: %lf Intensity: %lf \n", slope, prev_amp,
-                            ((slope*pulseWidth)+prev_amp), (double)((double)maxStripBrightness/(double)256));
-            }
-            /* Pulse is finished, insert a blank */
-            else if (colorFinished) {
-                pattern->ledstring.channel[0].leds[0] = 0;
-            } 
-            //printf("Prev Amp: %lf\n", prev_amp);
-            if (!colorFinished) { 
-                if (rampUp && ((uint32_t)i == ((uint32_t)pulseWidth-1))) {
-                    rampUp = false;
-                    maxStripBrightness = pattern->ledstring.channel[0].brightness;
-                    /* Recalculate slope for coming down to 0*/
-                    slope = (double)(((double)maxStripBrightness/(double)pulseWidth) / 256);
-                    slope = slope * (double)((double)intensity/(double)100);
-                }
-                
-                scalar = prev_amp;
-                prev_amp = (rampUp) ? (prev_amp + slope) : (prev_amp - slope);
-
-                red = ((uint32_t)(r_shift * scalar) << 16);
-                green = ((uint32_t)(g_shift * scalar) << 8);
-                blue = ((uint32_t)(b_shift * scalar));
-
-                pattern->ledstring.channel[0].leds[0] = (red+green+blue);
-                log_matrix_trace("Injecting %d %d %d\n", i, red, green, blue);
-                i = (rampUp) ? (i + 1) : (i - 1);
-                
-                if (i == 0) {
-                    colorFinished = true;
-                    prev_amp = 0;
-                }
-                assert(i >= 0);
-            }
-
-            if ((ret = ws2811_render(&pattern->ledstring)) != WS2811_SUCCESS) {
-                log_error("ws2811_render failed: %s", ws2811_get_return_t_str(ret));
-                // xxx: this should cause some sort of fatal error to propogate upwards
-                break;
-            }
+    bool newColor = pulse_collect(pattern);
+
+    move_lights(pattern, 1);
+    /* Set up boundary conditions of a single pulse */
+    if (newColor) {
+        // get prev_amp of previous pattern, which if the other ended, it should be zero
+        state->r_shift = (state->color & 0xFF0000) >> 16;
+        state->g_shift = (state->color & 0x00FF00) >> 8;
+        state->b_shift = (state->color & 0x0000FF);
+        state->colorFinished = true;
+
+        log_matrix_trace("Injecting");
+        //prev_amp = 0;
+        state->step = 0;
+        state->rampUp = true;
+        state->colorFinished = false;
+        
+        if (pattern->pulseWidth == 0) {
+            state->pulseWidth = state->intensity / 5;
+        }
+        else {
+            state->pulseWidth = pattern->pulseWidth;
+        }
+        
+        if (state->pulseWidth <= 1) {
+            state->pulseWidth = 2;
+        }
+        /* Calculate the slope at wherever the CURRENT led's brightness is
+         * to the maximum brightness. This could be interupting a different pulse,
+         * we ramp up from where we are */
+        /* Start with the maximum desired brightness */
+        // XXX rename me
+        state->maxStripBrightness = pattern->ledstring.channel[0].brightness;
+        /* Divide maximum brightness by the width of the pulse */
+        state->slope = (double)(((double)(state->maxStripBrightness-(state->prev_amp*256)) /
+                                 (double)state->pulseWidth) / 256);
+        /* Multiply by the intensity */
+        state->slope = state->slope * (double)((double)state->intensity/(double)100);
+        log_matrix_trace("Slope: %lf Prev_Amp: %lf Total: %lf Intensity: %lf", state->slope,
+                         state->prev_amp, ((state->slope*state->pulseWidth)+state->prev_amp),
+                         (double)((double)state->maxStripBrightness/(double)256));
+    }
+    /* Pulse is finished, insert a blank */
+    else if (state->colorFinished) {
+        *strip_led(pattern, 0) = 0;
+    } 
+    //printf("Prev Amp: %lf\n", prev_amp);
+    if (!state->colorFinished) { 
+        if (state->rampUp && ((uint32_t)state->step == ((uint32_t)state->pulseWidth-1))) {
+            state->rampUp = false;
+            state->maxStripBrightness = pattern->ledstring.channel[0].brightness;
+            /* Recalculate slope for coming down to 0*/
+            state->slope = (double)(((double)state->maxStripBrightness /
+                                     (double)state->pulseWidth) / 256);
+            state->slope = state->slope * (double)((double)state->intensity/(double)100);
+        }
+        
+        scalar = state->prev_amp;
+        state->prev_amp = (state->rampUp) ? (state->prev_amp + state->slope) :
+                                            (state->prev_amp - state->slope);
+
+        red = ((uint32_t)(state->r_shift * scalar) << 16);
+        green = ((uint32_t)(state->g_shift * scalar) << 8);
+        blue = ((uint32_t)(state->b_shift * scalar));
+
+        *strip_led(pattern, 0) = (red+green+blue);
+        log_matrix_trace("Injecting %d %d %d\n", state->step, red, green, blue);
+        state->step = (state->rampUp) ? (state->step + 1) : (state->step - 1);
+        
+        if (state->step == 0) {
+            state->colorFinished = true;
+            state->prev_amp = 0;
         }
-        usleep(1000000 / pattern->movement_rate);
+        assert(state->step >= 0);
     }
-    return NULL;
+
+    return WS2811_SUCCESS;
 }
 
-/* Initialize everything, and begin the thread */
+/* Initialize everything, the scheduler ticks the pattern from now on */
 ws2811_return_t
 pulse_load(struct pattern *pattern)
 {
     log_trace("pulse_load()");
 
-    /* A protection against matrix_run() being called in a bad order. */
+    if (pattern->ledstring.channel[0].count <= 0) {
+        log_error("Pattern Pulse: The string has no LEDs");
+        return WS2811_ERROR_GENERIC;
+    }
+
+    memset(pattern->pulse, 0, sizeof(*pattern->pulse));
+    pattern->pulse->rampUp = true;
+    pattern->pulse->colorFinished = true;
+
+    /* A protection against pulse_tick() being called in a bad order. */
     pattern->running = 1;
 
-    pthread_create(&pattern->thread_id, NULL, matrix_run2, pattern);
     log_info("Pattern Pulse: Loop is now running.");
     return WS2811_SUCCESS;
 }
@@ -216,14 +260,10 @@ pulse_clear(struct pattern *pattern)
     ws2811_return_t ret = WS2811_SUCCESS;
     uint32_t i;
 
-    for (i = 0; i < pattern->led_count; i++) {
+    /* The scheduler renders the cleared layer */
+    for (i = 0; i < (uint32_t)pattern->ledstring.channel[0].count; i++) {
         pattern->ledstring.channel[0].leds[i] = 0;
     }
-
-    if ((ret = ws2811_render(&pattern->ledstring)) != WS2811_SUCCESS) {
-        log_error("ws2811_render failed: %s", ws2811_get_return_t_str(ret));
-        // xxx: this should cause some sort of fatal error to propogate upwards
-    }
     return ret;
 }
 
@@ -235,7 +275,7 @@ pulse_pause(struct pattern *pattern)
     return WS2811_SUCCESS;
 }
 
-/* Turn off strip, kill second process */
+/* Stop the pattern, the scheduler no longer ticks it */
 ws2811_return_t
 pulse_kill(struct pattern *pattern)
 {
@@ -243,9 +283,6 @@ pulse_kill(struct pattern *pattern)
     log_debug("Pattern Pulse: Stopping run");
     pattern->running = 0;
 
-    log_debug("Pattern Pulse: Loop Waiting for thread %d to end", pattern->thread_id);
-    pthread_join(pattern->thread_id, NULL);
-
     if (pattern->clear_on_exit) {
         pulse_clear(pattern);
     }
@@ -268,13 +305,23 @@ pulse_create(struct pattern **pattern)
     (*pattern)->func_start_pattern = &pulse_start;
     (*pattern)->func_kill_pattern = &pulse_kill;
     (*pattern)->func_pause_pattern = &pulse_pause;
+    (*pattern)->func_tick = &pulse_tick;
     (*pattern)->func_inject = &pulse_inject;
 
+    (*pattern)->pulse = calloc(1, sizeof(struct pulse_state));
+    if ((*pattern)->pulse == NULL) {
+        log_error("Pattern Pulse: Unable to allocate memory for pattern\n");
+        free(*pattern);
+        *pattern = NULL;
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
     /* Set default values */
     (*pattern)->running = true;
     (*pattern)->paused = true;
-    (*pattern)->matrix = NULL;
+    (*pattern)->layout.map = NULL;
     (*pattern)->pulseWidth = 0;
+    inject_queue_init(&(*pattern)->inject);
     return WS2811_SUCCESS;
 }   
 
@@ -283,8 +330,8 @@ pulse_delete(struct pattern *pattern)
 {
     log_trace("pulse_delete()");
     log_debug("Pattern Pulse: Freeing objects");
-    free(pattern->matrix);
-    pattern->matrix = NULL;
+    layout_fini(&pattern->layout);
+    free(pattern->pulse);
     free(pattern);
     return WS2811_SUCCESS;
 }
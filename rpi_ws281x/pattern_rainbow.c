@@ -82,19 +82,24 @@ ws2811_led_t dotcolors_rgbw[] =
 };
 
 
-/* Stamp onto the string */
-void matrix_render(struct pattern *pattern)
+/* The matrix is drawn straight into the LEDs of the string in logical order, the layout puts
+ * each one where it sits on the string as the driver reads them.  The rows are a ring turned
+ * by the channel offset, rainbow_load() makes sure it has LEDs. */
+static ws2811_led_t *matrix_cell(struct pattern *pattern, int x, int y)
 {
-    log_matrix_trace("matrix_renderer()");
-    int x, y;
-    int width = pattern->width;
-    int height = pattern->height;
-    for (x = 0; x < width; x++)
+    ws2811_channel_t *channel = &pattern->ledstring.channel[0];
+
+    return &channel->leds[(y * pattern->width + x + channel->offset) % channel->count];
+}
+
+/* Clear whatever the matrix shows on LED i of the string */
+static void matrix_clear_led(struct pattern *pattern, uint32_t i)
+{
+    ws2811_channel_t *channel = &pattern->ledstring.channel[0];
+
+    if ((i < (uint32_t)channel->count) && (pattern->layout.map[i] != WS2811_MAP_NONE))
     {
-        for (y = 0; y < height; y++)
-        {   
-            pattern->ledstring.channel[0].leds[(y * width) + x] = pattern->matrix[y * width + x];
-        }
+        channel->leds[(pattern->layout.map[i] + channel->offset) % channel->count] = 0;
     }
 }
 
@@ -102,35 +107,31 @@ void matrix_render(struct pattern *pattern)
 void matrix_raise(struct pattern *pattern)
 {
     log_matrix_trace("matrix_raise()");
-    int x, y;
+    ws2811_channel_t *channel = &pattern->ledstring.channel[0];
+    int x;
     int height = pattern->height;
     int width = pattern->width;
     /* See if height is 1, then this is one dimensional */
-    for (y = 0; y < (height - 1); y++)
+    if ((height < 2) || !channel->count)
     {
-        for (x = 0; x < width; x++)
-        {
-            // This is for the 8x8 Pimoroni Unicorn-HAT where the LEDS in subsequent
-            // rows are arranged in opposite directions
-            pattern->matrix[y * width + x] = pattern->matrix[(y + 1)*width + width - x - 1];
-        }
+        return;
+    }
+    // The top row drops off and its LEDs become the bottom row, which keeps what the bottom
+    // row showed so far
+    channel->offset = (channel->offset + width) % channel->count;
+    for (x = 0; x < width; x++)
+    {
+        *matrix_cell(pattern, x, height - 1) = *matrix_cell(pattern, x, height - 2);
     }
 }
 
 void matrix_clear(struct pattern *pattern)
 {
     log_matrix_trace("matrix_clear()");
-    int x, y;
-    int height = pattern->height;
-    int width = pattern->width;
+    ws2811_channel_t *channel = &pattern->ledstring.channel[0];
 
-    for (y = 0; y < (height ); y++)
-    {
-        for (x = 0; x < width; x++)
-        {
-            pattern->matrix[y * width + x] = 0;
-        }
-    }
+    memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
+    channel->offset = 0;
 }
 
 void matrix_bottom(struct pattern *pattern)
@@ -149,73 +150,75 @@ void matrix_bottom(struct pattern *pattern)
 
         /* Not mine */
         if (pattern->ledstring.channel[0].strip_type == SK6812_STRIP_RGBW) {
-            pattern->matrix[dotspos[i] + (pattern->height - 1) * pattern->width] = dotcolors_rgbw[i];
+            *matrix_cell(pattern, dotspos[i], pattern->height - 1) = dotcolors_rgbw[i];
         }
         /* Mine */
         else {
-            pattern->matrix[dotspos[i] + (pattern->height - 1) * pattern->width] = dotcolors[i];
+            *matrix_cell(pattern, dotspos[i], pattern->height - 1) = dotcolors[i];
         }
     }
     /* XXX: This clears all lights that are not currently in the array */
     i = 0;
     while (i < dotspos[0]) {
-        pattern->matrix[i] = 0;
+        matrix_clear_led(pattern, i);
         i++;
     }
     if (dotspos[7] == pattern->led_count-1) {
-        pattern->matrix[dotspos[7]] = 0;
+        matrix_clear_led(pattern, dotspos[7]);
     }
     if (dotspos[7] == pattern->led_count) {
-        pattern->matrix[pattern->led_count] = 0;
+        matrix_clear_led(pattern, pattern->led_count);
     }
 }
 
-/* Run the threaded loop */
-void *
-matrix_run(void *vargp)
+/* Draw the next frame, called by the scheduler */
+ws2811_return_t
+rainbow_tick(struct pattern *pattern)
 {
-    log_matrix_trace("rainbow_run()");
+    log_matrix_trace("rainbow_tick()");
 
-    ws2811_return_t ret;
-    struct pattern *pattern = (struct pattern*)vargp;
+    matrix_raise(pattern);
+    matrix_bottom(pattern);
 
-    /* This should never get called before load_rainbox_pattern initializes stuff.
-     * Or ever be called after kill_pattern_rainbox */
-    assert(pattern->running);
-    while (pattern->running)
-    {
-        /* If the pattern is paused, we won't update anything */
-        if (!pattern->paused) {
-            matrix_raise(pattern);
-            matrix_bottom(pattern);
-            matrix_render(pattern);
-            if ((ret = ws2811_render(&pattern->ledstring)) != WS2811_SUCCESS)
-            {
-                log_error("ws2811_render failed: %s", ws2811_get_return_t_str(ret));
-                // XXX: This should cause some sort of fatal error to propogate upwards
-                break;
-            }
-        }
-        // 15 frames /sec
-        usleep(1000000 / pattern->movement_rate);
-    }
-
-    return NULL;
+    return WS2811_SUCCESS;
 }
 
-/* Initialize everything, and begin the thread */
+/* Initialize everything, the scheduler ticks the pattern from now on */
 ws2811_return_t
 rainbow_load(struct pattern *pattern)
 {
     log_trace("rainbow_load()");
 
-    /* Allocate memory */
-    pattern->matrix = calloc(pattern->width*pattern->height, sizeof(ws2811_led_t));
+    ws2811_return_t ret;
+    /* The Unicorn-HAT rows alternate, with the bottom row running forwards */
+    int flags = LAYOUT_SERPENTINE | ((pattern->height & 1) ? 0 : LAYOUT_REVERSE);
+
+    /* The matrix is a ring of LEDs, there must be some */
+    if (pattern->ledstring.channel[0].count <= 0) {
+        log_error("Rainbow Pattern: The string has no LEDs");
+        return WS2811_ERROR_GENERIC;
+    }
 
-    /* A protection against matrix_run() being called in a bad order. */
+    /* Build the map of the matrix once */
+    if (pattern->layout_file) {
+        ret = layout_load(&pattern->layout, pattern->layout_file, pattern->ledstring.channel[0].count);
+    }
+    else {
+        ret = layout_init(&pattern->layout, pattern->width, pattern->height,
+                          pattern->ledstring.channel[0].count, flags);
+    }
+    if (ret != WS2811_SUCCESS) {
+        log_error("Rainbow Pattern: Unable to set up the matrix layout");
+        return ret;
+    }
+    pattern->width = pattern->layout.width;
+    pattern->height = pattern->layout.height;
+    matrix_clear(pattern);
+    pattern->ledstring.channel[0].map = pattern->layout.map;
+
+    /* A protection against rainbow_tick() being called in a bad order. */
     pattern->running = 1;
 
-    pthread_create(&pattern->thread_id, NULL, matrix_run, pattern);
     log_info("Rainbow Pattern Loop is now running.");
     return WS2811_SUCCESS;
 }
@@ -245,7 +248,7 @@ rainbow_pause(struct pattern *pattern)
     return WS2811_SUCCESS;
 }
 
-/* Turn off strip, kill second process */
+/* Stop the pattern, the scheduler no longer ticks it */
 ws2811_return_t
 rainbow_kill(struct pattern *pattern)
 {
@@ -254,14 +257,10 @@ rainbow_kill(struct pattern *pattern)
     log_debug("Rainbow Pattern Loop: Stopping run");
     pattern->running = 0;
 
-    log_debug("Rainbow Pattern Loop: Waiting for thread %d to end", pattern->thread_id);
-    pthread_join(pattern->thread_id, NULL);
-
+    /* The scheduler renders the cleared layer */
     if (pattern->clear_on_exit) {
         log_info("Raindow Pattern Loop: Clearing matrix");
         matrix_clear(pattern);
-        matrix_render(pattern);
-        ws2811_render(&pattern->ledstring);
     }
 
     log_info("Rainbow Pattern Loop: now stopped");
@@ -281,8 +280,12 @@ rainbow_create(struct pattern **pattern)
     (*pattern)->func_start_pattern = &rainbow_start;
     (*pattern)->func_kill_pattern = &rainbow_kill;
     (*pattern)->func_pause_pattern = &rainbow_pause;
+    (*pattern)->func_tick = &rainbow_tick;
     (*pattern)->running = true;
     (*pattern)->paused = true;
+    (*pattern)->layout_file = NULL;
+    (*pattern)->layout.map = NULL;
+    (*pattern)->pulse = NULL;
     return WS2811_SUCCESS;
 }   
 
@@ -292,8 +295,8 @@ rainbow_delete(struct pattern *pattern)
     //rainbow_kill(pattern);
     log_trace("rainbow_delete()");
     log_debug("Rainbow Pattern: Freeing objects");
-    free(pattern->matrix);
-    pattern->matrix = NULL;
+    pattern->ledstring.channel[0].map = NULL;
+    layout_fini(&pattern->layout);
     free(pattern);
     return WS2811_SUCCESS;
 }
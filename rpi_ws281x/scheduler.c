@@ -0,0 +1,480 @@
+/*
+ * scheduler.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ws2811.h"
+#include "pattern.h"
+#include "scheduler.h"
+#include "monotonic.h"
+
+
+// Longest the thread sleeps, so stopping or resuming a pattern is noticed quickly
+#define SCHEDULER_SLEEP_MAX_NS                   50000000
+
+/**
+ * Work out how many ticks are due at a point in time and move the deadline on by as many
+ * periods.  Deadlines stay on the grid of the first one, however late a tick runs.  When
+ * deadlines were missed the policy decides whether their ticks are dropped or run now.
+ *
+ * @param    clock  Frame clock, a next_ns of 0 starts the schedule at now.
+ * @param    now    CLOCK_MONOTONIC time in nanoseconds.
+ *
+ * @returns  Number of ticks to run, 0 before the deadline.
+ */
+int frame_clock_due(frame_clock_t *clock, uint64_t now)
+{
+    uint64_t late, missed;
+    int due = 1;
+
+    if (!clock->next_ns)
+    {
+        clock->next_ns = now;
+    }
+    if (now < clock->next_ns)
+    {
+        return 0;
+    }
+
+    late = now - clock->next_ns;
+    if (late > clock->max_late_ns)
+    {
+        clock->max_late_ns = late;
+    }
+
+    // Deadlines after this one that have passed as well
+    missed = late / clock->period_ns;
+    if (missed)
+    {
+        clock->late++;
+
+        if (clock->policy == OVERRUN_CATCH_UP)
+        {
+            due += (missed < FRAME_CLOCK_CATCH_UP_MAX - 1) ? missed : (FRAME_CLOCK_CATCH_UP_MAX - 1);
+            missed -= due - 1;
+        }
+        clock->skipped += missed;
+    }
+
+    clock->next_ns += (missed + due) * clock->period_ns;
+    clock->ticks += due;
+
+    return due;
+}
+
+/**
+ * Give a layer LEDs of its own, keeping what the pattern drew so far.
+ *
+ * @param    scheduler  Scheduler.
+ * @param    layer      Layer.
+ *
+ * @returns  0 on success, < 0 otherwise.
+ */
+static ws2811_return_t layer_alloc(scheduler_t *scheduler, scheduler_layer_t *layer)
+{
+    ws2811_channel_t *channel = &layer->pattern->ledstring.channel[0];
+    int count = scheduler->ws2811->channel[0].count;
+
+    layer->leds = malloc(sizeof(ws2811_led_t) * count);
+    if (!layer->leds)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    memcpy(layer->leds, channel->leds, sizeof(ws2811_led_t) * count);
+    channel->leds = layer->leds;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * LED i of the strip as a layer shows it, through its ring offset and map.  The layer has
+ * LEDs, scheduler_add() makes sure.
+ *
+ * @param    channel  Layer channel.
+ * @param    i        Strip LED.
+ *
+ * @returns  Colour of the LED.
+ */
+static ws2811_led_t layer_led(const ws2811_channel_t *channel, int i)
+{
+    uint32_t index = channel->map ? channel->map[i] : (uint32_t)i;
+
+    if (index == WS2811_MAP_NONE)
+    {
+        return 0;
+    }
+
+    return channel->leds[(index + channel->offset) % channel->count];
+}
+
+/**
+ * Blend an LED of a layer onto the LED below it, each colour on its own.
+ *
+ * @param    below  LED below.
+ * @param    led    LED of the layer.
+ * @param    blend  Blend mode.
+ *
+ * @returns  Blended LED.
+ */
+static ws2811_led_t blend_led(ws2811_led_t below, ws2811_led_t led, blend_mode_t blend)
+{
+    ws2811_led_t out = 0;
+    int shift;
+
+    switch (blend)
+    {
+        case BLEND_REPLACE:
+            return led;
+
+        case BLEND_OVER:
+            return led ? led : below;
+
+        default:
+            break;
+    }
+
+    for (shift = 0; shift < 32; shift += 8)
+    {
+        uint32_t a = (below >> shift) & 0xff;
+        uint32_t b = (led >> shift) & 0xff;
+        uint32_t c;
+
+        switch (blend)
+        {
+            case BLEND_ADD:
+                c = (a + b > 0xff) ? 0xff : (a + b);
+                break;
+
+            case BLEND_MAX:
+                c = (a > b) ? a : b;
+                break;
+
+            default:
+                c = (a * b + 127) / 255;
+                break;
+        }
+
+        out |= c << shift;
+    }
+
+    return out;
+}
+
+/**
+ * Blend the layers into the output and render them.  A lone layer drawing straight into the
+ * output only hands its ring offset and map on.  Called with the lock held.
+ *
+ * @param    scheduler  Scheduler.
+ *
+ * @returns  0 on success, < 0 otherwise.
+ */
+static ws2811_return_t render_locked(scheduler_t *scheduler)
+{
+    ws2811_channel_t *output = &scheduler->ws2811->channel[0];
+    int l, i;
+
+    if ((scheduler->layer_count == 1) && !scheduler->layer[0].leds)
+    {
+        const ws2811_channel_t *channel = &scheduler->layer[0].pattern->ledstring.channel[0];
+
+        output->offset = channel->offset;
+        output->map = channel->map;
+    }
+    else
+    {
+        output->offset = 0;
+        output->map = NULL;
+
+        for (l = 0; l < scheduler->layer_count; l++)
+        {
+            const scheduler_layer_t *layer = &scheduler->layer[l];
+            const ws2811_channel_t *channel = &layer->pattern->ledstring.channel[0];
+
+            for (i = 0; i < output->count; i++)
+            {
+                output->leds[i] = blend_led(l ? output->leds[i] : 0, layer_led(channel, i),
+                                            layer->blend);
+            }
+        }
+    }
+
+    scheduler->frames++;
+
+    return ws2811_render(scheduler->ws2811);
+}
+
+/**
+ * Tick every pattern that is due on its frame clock, then render one frame if any of them
+ * drew something.  Patterns due at the same time share the frame.
+ *
+ * @param    arg  Scheduler.
+ *
+ * @returns  NULL
+ */
+static void *scheduler_thread(void *arg)
+{
+    scheduler_t *scheduler = arg;
+    ws2811_return_t ret;
+
+    while (scheduler->running)
+    {
+        uint64_t now = monotonic_ns();
+        uint64_t next = now + SCHEDULER_SLEEP_MAX_NS;
+        int ticked = 0;
+        int l;
+
+        pthread_mutex_lock(&scheduler->lock);
+
+        for (l = 0; l < scheduler->layer_count; l++)
+        {
+            scheduler_layer_t *layer = &scheduler->layer[l];
+            struct pattern *pattern = layer->pattern;
+            int due;
+
+            // A paused pattern starts on a new schedule when it resumes
+            if (!pattern->running || pattern->paused || (pattern->movement_rate <= 0))
+            {
+                layer->clock.next_ns = 0;
+                continue;
+            }
+
+            layer->clock.period_ns = 1000000000 / pattern->movement_rate;
+            layer->clock.policy = scheduler->overrun;
+
+            for (due = frame_clock_due(&layer->clock, now); due; due--)
+            {
+                pattern->func_tick(pattern);
+                scheduler->ticks++;
+                ticked = 1;
+            }
+
+            if (layer->clock.next_ns < next)
+            {
+                next = layer->clock.next_ns;
+            }
+        }
+
+        ret = ticked ? render_locked(scheduler) : WS2811_SUCCESS;
+
+        pthread_mutex_unlock(&scheduler->lock);
+
+        if (ret != WS2811_SUCCESS)
+        {
+            fprintf(stderr, "Scheduler stopped, render failed: %s\n", ws2811_get_return_t_str(ret));
+            break;
+        }
+
+        monotonic_sleep_until(next);
+    }
+
+    return NULL;
+}
+
+/**
+ * Set up a scheduler without layers for an output.
+ *
+ * @param    scheduler  Scheduler.
+ * @param    ws2811     Initialized output, only the scheduler renders it from now on.
+ *
+ * @returns  0 on success, < 0 otherwise.
+ */
+ws2811_return_t scheduler_init(scheduler_t *scheduler, ws2811_t *ws2811)
+{
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->ws2811 = ws2811;
+
+    if (!ws2811->device || !ws2811->channel[0].count)
+    {
+        fprintf(stderr, "Scheduler needs an initialized output with LEDs on channel 0\n");
+        return WS2811_ERROR_GENERIC;
+    }
+
+    pthread_mutex_init(&scheduler->lock, NULL);
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Stop the scheduler and free the layers.  The patterns belong to the caller.
+ *
+ * @param    scheduler  Scheduler.
+ *
+ * @returns  None
+ */
+void scheduler_fini(scheduler_t *scheduler)
+{
+    int l;
+
+    scheduler_stop(scheduler);
+
+    for (l = 0; l < scheduler->layer_count; l++)
+    {
+        free(scheduler->layer[l].leds);
+        scheduler->layer[l].leds = NULL;
+    }
+    scheduler->layer_count = 0;
+    scheduler->ws2811->channel[0].offset = 0;
+    scheduler->ws2811->channel[0].map = NULL;
+
+    pthread_mutex_destroy(&scheduler->lock);
+}
+
+/**
+ * Give a pattern a layer on top of the ones added so far.  The pattern's ledstring becomes a
+ * description of the layer with LEDs the size of the output, its own ring offset and map, and
+ * no device: only the scheduler renders.  Layers are added before the scheduler is started
+ * and before the pattern is loaded.
+ *
+ * @param    scheduler  Scheduler.
+ * @param    pattern    Pattern to tick, with its movement rate set.
+ * @param    blend      How the layer combines with the layers below.
+ *
+ * @returns  0 on success, < 0 otherwise.
+ */
+ws2811_return_t scheduler_add(scheduler_t *scheduler, struct pattern *pattern, blend_mode_t blend)
+{
+    ws2811_channel_t *output = &scheduler->ws2811->channel[0];
+    scheduler_layer_t *layer;
+    ws2811_return_t ret;
+
+    if (scheduler->running || (scheduler->layer_count == SCHEDULER_LAYERS_MAX) ||
+        !pattern->func_tick)
+    {
+        fprintf(stderr, "Scheduler can't take another layer\n");
+        return WS2811_ERROR_GENERIC;
+    }
+
+    // Layers are rings the size of the output, an empty one has no LED to wrap around to
+    if (output->count <= 0)
+    {
+        fprintf(stderr, "Scheduler output has no LEDs\n");
+        return WS2811_ERROR_GENERIC;
+    }
+
+    // Blending needs the first layer out of the output
+    if ((scheduler->layer_count == 1) && !scheduler->layer[0].leds)
+    {
+        if ((ret = layer_alloc(scheduler, &scheduler->layer[0])) != WS2811_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    layer = &scheduler->layer[scheduler->layer_count];
+    layer->pattern = pattern;
+    layer->blend = blend;
+    layer->leds = NULL;
+    memset(&layer->clock, 0, sizeof(layer->clock));
+
+    pattern->ledstring = *scheduler->ws2811;
+    pattern->ledstring.device = NULL;
+    pattern->ledstring.channel[0].leds = output->leds;
+    pattern->ledstring.channel[0].offset = 0;
+    pattern->ledstring.channel[0].map = NULL;
+
+    if (scheduler->layer_count || (blend != BLEND_REPLACE))
+    {
+        if ((ret = layer_alloc(scheduler, layer)) != WS2811_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    scheduler->layer_count++;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Start ticking the patterns.  Paused patterns are skipped until they are started.
+ *
+ * @param    scheduler  Scheduler.
+ *
+ * @returns  0 on success, < 0 otherwise.
+ */
+ws2811_return_t scheduler_start(scheduler_t *scheduler)
+{
+    if (scheduler->running)
+    {
+        return WS2811_SUCCESS;
+    }
+
+    scheduler->running = 1;
+    if (pthread_create(&scheduler->thread, NULL, scheduler_thread, scheduler))
+    {
+        scheduler->running = 0;
+        return WS2811_ERROR_GENERIC;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Stop ticking the patterns and wait for the thread.  The output keeps its last frame, see
+ * scheduler_render() to send what the layers hold after that.
+ *
+ * @param    scheduler  Scheduler.
+ *
+ * @returns  None
+ */
+void scheduler_stop(scheduler_t *scheduler)
+{
+    if (!scheduler->running)
+    {
+        return;
+    }
+
+    scheduler->running = 0;
+    pthread_join(scheduler->thread, NULL);
+}
+
+/**
+ * Blend the layers and render one frame now, e.g. after patterns cleared their layer on the
+ * way out.
+ *
+ * @param    scheduler  Scheduler.
+ *
+ * @returns  0 on success, < 0 otherwise.
+ */
+ws2811_return_t scheduler_render(scheduler_t *scheduler)
+{
+    ws2811_return_t ret;
+
+    pthread_mutex_lock(&scheduler->lock);
+    ret = render_locked(scheduler);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return ret;
+}
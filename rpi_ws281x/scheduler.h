@@ -0,0 +1,118 @@
+/*
+ * scheduler.h
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+
+#include "ws2811.h"
+
+
+#define SCHEDULER_LAYERS_MAX                     4
+
+struct pattern;
+
+// How a layer combines with the layers below it
+typedef enum {
+    BLEND_REPLACE,                               // Layer covers everything below
+    BLEND_OVER,                                  // Lit LEDs of the layer cover what is below
+    BLEND_ADD,                                   // Colours add up, clipped at full
+    BLEND_MAX,                                   // Brightest of each colour
+    BLEND_MULTIPLY,                              // Layer scales what is below, a mask
+} blend_mode_t;
+
+// What a frame clock does about deadlines that passed while the last tick ran
+typedef enum {
+    OVERRUN_SKIP,                                // Drop the missed ticks and stay on the schedule
+    OVERRUN_CATCH_UP,                            // Run them back to back, FRAME_CLOCK_CATCH_UP_MAX at most
+} overrun_policy_t;
+
+#define FRAME_CLOCK_CATCH_UP_MAX                 32
+
+/*
+ * Ticks on a fixed schedule of absolute deadlines, so time spent drawing and rendering does
+ * not slow the rate down or make it drift.
+ */
+typedef struct
+{
+    uint64_t period_ns;                          //< Time between deadlines
+    uint64_t next_ns;                            //< CLOCK_MONOTONIC deadline of the next tick, 0 to restart
+    overrun_policy_t policy;                     //< What to do about missed deadlines
+    uint64_t ticks;                              //< Ticks run
+    uint64_t late;                               //< Times one or more deadlines had passed already
+    uint64_t skipped;                            //< Ticks dropped for missed deadlines
+    uint64_t max_late_ns;                        //< Worst lateness against a deadline
+} frame_clock_t;
+
+typedef struct
+{
+    struct pattern *pattern;                     //< Pattern drawing the layer
+    blend_mode_t blend;                          //< Blend mode
+    ws2811_led_t *leds;                          //< Layer LEDs, NULL when drawn straight into the output
+    frame_clock_t clock;                         //< Ticks at the movement rate of the pattern
+} scheduler_layer_t;
+
+/*
+ * Single owner of an output.  Patterns draw into their own layer when the scheduler ticks
+ * them at their movement rate, and the layers are blended bottom up and rendered once per
+ * frame.  A lone layer replacing everything draws straight into the output instead.
+ */
+typedef struct
+{
+    ws2811_t *ws2811;                            //< Initialized output, channel 0 is used
+    scheduler_layer_t layer[SCHEDULER_LAYERS_MAX];  //< Layers, bottom first
+    int layer_count;
+    pthread_t thread;                            //< Thread ticking the patterns
+    pthread_mutex_t lock;                        //< Held while ticking and rendering
+    volatile int running;
+    overrun_policy_t overrun;                    //< Overrun policy of the layers, OVERRUN_SKIP by default
+    uint64_t frames;                             //< Frames rendered
+    uint64_t ticks;                              //< Pattern ticks, several can share a frame
+} scheduler_t;
+
+int frame_clock_due(frame_clock_t *clock, uint64_t now);  //< Ticks to run at now, moves the deadline on
+ws2811_return_t scheduler_init(scheduler_t *scheduler, ws2811_t *ws2811);  //< Set up an empty scheduler
+void scheduler_fini(scheduler_t *scheduler);     //< Stop and free the layers
+ws2811_return_t scheduler_add(scheduler_t *scheduler, struct pattern *pattern,
+                              blend_mode_t blend);  //< Give a pattern a layer, before loading it
+ws2811_return_t scheduler_start(scheduler_t *scheduler);  //< Start ticking the patterns
+void scheduler_stop(scheduler_t *scheduler);     //< Stop ticking, the output keeps its last frame
+ws2811_return_t scheduler_render(scheduler_t *scheduler);  //< Blend the layers and render one frame
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SCHEDULER_H__ */
@@ -0,0 +1,538 @@
+/*
+ * sim.c
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "sim.h"
+#include "monotonic.h"
+
+
+// Bus address the simulated VideoCore memory appears at, the L2 coherent alias
+#define SIM_MEM_BUS                              0xc0000000
+#define SIM_MEM_ALIGN                            4096
+
+// FIFO bus addresses a control block can write to
+#define SIM_PWM_FIFO_BUS                         (PWM_PERIPH_PHYS + offsetof(pwm_t, fif1))
+#define SIM_PCM_FIFO_BUS                         (PCM_PERIPH_PHYS + offsetof(pcm_t, fifo))
+
+/**
+ * Allocate a simulated register set and VideoCore memory.
+ *
+ * @param    mem_size  Bytes of memory to allocate.
+ *
+ * @returns  Simulator or NULL if out of memory.
+ */
+sim_t *sim_create(uint32_t mem_size)
+{
+    sim_t *sim = calloc(1, sizeof(*sim));
+
+    if (!sim)
+    {
+        return NULL;
+    }
+
+    if (posix_memalign((void **)&sim->mem, SIM_MEM_ALIGN, mem_size))
+    {
+        free(sim);
+        return NULL;
+    }
+    memset(sim->mem, 0, mem_size);
+
+    sim->mem_bus = SIM_MEM_BUS;
+    sim->mem_size = mem_size;
+    sim->mode = SIM_INSTANT;
+
+    return sim;
+}
+
+/**
+ * Free a simulator created by sim_create(), stopping the timed model first.
+ *
+ * @param    sim  Simulator, may be NULL.
+ *
+ * @returns  None
+ */
+void sim_destroy(sim_t *sim)
+{
+    if (!sim)
+    {
+        return;
+    }
+
+    if (sim->running)
+    {
+        sim->running = 0;
+        pthread_join(sim->thread, NULL);
+    }
+
+    free(sim->frame);
+    free(sim->mem);
+    free(sim);
+}
+
+/**
+ * Translate a bus address range into the simulated memory.
+ *
+ * @param    sim   Simulator.
+ * @param    addr  Bus address.
+ * @param    len   Bytes needed at addr.
+ *
+ * @returns  Pointer into sim->mem or NULL if the range is outside of it.
+ */
+static uint8_t *sim_bus_to_virt(sim_t *sim, uint32_t addr, uint32_t len)
+{
+    uint32_t offset = addr - sim->mem_bus;
+
+    if ((addr < sim->mem_bus) || (offset > sim->mem_size) || (len > sim->mem_size - offset))
+    {
+        return NULL;
+    }
+
+    return sim->mem + offset;
+}
+
+static uint32_t sim_reg(uint32_t *reg)
+{
+    return __atomic_load_n(reg, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Change bits of a register the driver may write at the same time, without losing its write.
+ *
+ * @param    reg    Register.
+ * @param    clear  Bits to clear.
+ * @param    set    Bits to set.
+ *
+ * @returns  None
+ */
+static void sim_reg_update(uint32_t *reg, uint32_t clear, uint32_t set)
+{
+    uint32_t old = sim_reg(reg);
+
+    while (!__atomic_compare_exchange_n(reg, &old, (old & ~clear) | set, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        ;
+}
+
+/**
+ * Load a control block into the DMA registers and capture the data it sends in sim->frame.
+ * The channel is flagged in error if the control block or its source lies outside of the
+ * simulated memory.
+ *
+ * @param    sim   Simulator.
+ * @param    addr  Bus address of the control block.
+ *
+ * @returns  0 on success, -1 on a read error.
+ */
+static int sim_cb_load(sim_t *sim, uint32_t addr)
+{
+    dma_cb_t *cb = (dma_cb_t *)sim_bus_to_virt(sim, addr, sizeof(dma_cb_t));
+    uint8_t *src = cb ? sim_bus_to_virt(sim, cb->source_ad, cb->txfr_len) : NULL;
+    uint8_t *frame;
+
+    if (!src || (addr & 0x1f))
+    {
+        sim->dma.debug |= 1;                     // Read error
+        sim_reg_update(&sim->dma.cs, RPI_DMA_CS_ACTIVE, RPI_DMA_CS_ERROR);
+        return -1;
+    }
+
+    sim->dma.conblk_ad = addr;
+    sim->dma.ti = cb->ti;
+    sim->dma.source_ad = cb->source_ad;
+    sim->dma.dest_ad = cb->dest_ad;
+    sim->dma.txfr_len = cb->txfr_len;
+    sim->dma.nextconbk = cb->nextconbk;
+
+    frame = realloc(sim->frame, cb->txfr_len);
+    if (frame)
+    {
+        memcpy(frame, src, cb->txfr_len);
+        sim->frame = frame;
+        sim->frame_len = cb->txfr_len;
+    }
+
+    sim->last_conblk_ad = addr;
+
+    return 0;
+}
+
+/**
+ * Run the control block chain loaded into the simulated DMA channel.  The data of each block
+ * is captured in sim->frame and the channel is left idle, or flagged in error if a control block
+ * or its source lies outside of the simulated memory.  Nothing to do for the timed model, its
+ * thread picks the transfer up.
+ *
+ * @param    sim  Simulator.
+ *
+ * @returns  None
+ */
+void sim_dma_run(sim_t *sim)
+{
+    uint32_t addr = sim->dma.conblk_ad;
+
+    if ((sim->mode != SIM_INSTANT) || !(sim->dma.cs & RPI_DMA_CS_ACTIVE))
+    {
+        return;
+    }
+
+    // Written along with ACTIVE INT and END clear the flags of the last transfer
+    sim->dma.cs &= ~(RPI_DMA_CS_INT | RPI_DMA_CS_END);
+
+    while (addr)
+    {
+        if (sim_cb_load(sim, addr))
+        {
+            return;
+        }
+
+        sim->transfers++;
+        addr = sim->dma.nextconbk;
+    }
+
+    sim->dma.conblk_ad = 0;
+    sim->dma.cs = (sim->dma.cs & ~RPI_DMA_CS_ACTIVE) | RPI_DMA_CS_END;
+    sim->pcm.cs |= RPI_PCM_CS_TXE;               // FIFO drained
+}
+
+/**
+ * FIFO a DMA destination address belongs to, with the level up to which the peripheral
+ * requests data.
+ *
+ * @param    sim        Simulator.
+ * @param    dest       Bus address written by the control block.
+ * @param    threshold  Filled with the FIFO level DREQ stays asserted below.
+ *
+ * @returns  FIFO level, NULL if the destination is not a modelled FIFO.
+ */
+static uint32_t *sim_dma_fifo(sim_t *sim, uint32_t dest, uint32_t *threshold)
+{
+    int dreq = sim->dma.ti & RPI_DMA_TI_DEST_DREQ;
+
+    if (dest == SIM_PWM_FIFO_BUS)
+    {
+        uint32_t dmac = sim_reg(&sim->pwm.dmac);
+
+        *threshold = !dreq ? SIM_PWM_FIFO_WORDS :
+                     !(dmac & RPI_PWM_DMAC_ENAB) ? 0 : (dmac & 0xff);
+        if (*threshold > SIM_PWM_FIFO_WORDS)
+        {
+            *threshold = SIM_PWM_FIFO_WORDS;
+        }
+        return &sim->pwm_fifo;
+    }
+
+    if (dest == SIM_PCM_FIFO_BUS)
+    {
+        *threshold = !dreq ? SIM_PCM_FIFO_WORDS :
+                     !(sim_reg(&sim->pcm.cs) & RPI_PCM_CS_DMAEN) ? 0 :
+                     ((sim_reg(&sim->pcm.dreq) >> 8) & 0x7f);
+        if (*threshold > SIM_PCM_FIFO_WORDS)
+        {
+            *threshold = SIM_PCM_FIFO_WORDS;
+        }
+        return &sim->pcm_fifo;
+    }
+
+    return NULL;
+}
+
+/**
+ * Let the DMA move as much data as the FIFO requests at time t.  A control block is loaded
+ * from conblk_ad when the channel is activated, the next one once it is done, and END is
+ * set after the last word of the chain has been written.
+ *
+ * @param    sim  Simulator.
+ * @param    t    Model time.
+ *
+ * @returns  None
+ */
+static void sim_dma_fill(sim_t *sim, uint64_t t)
+{
+    for (;;)
+    {
+        uint32_t cs = sim_reg(&sim->dma.cs);
+        uint32_t *fifo, threshold, words;
+
+        if (!(cs & RPI_DMA_CS_ACTIVE) || (cs & RPI_DMA_CS_ERROR))
+        {
+            return;
+        }
+
+        // Channel activated, the chain starts at conblk_ad.  Not before the activation was
+        // seen, a serializer catching up must not pull data from the past.
+        if (!sim->dma_dest)
+        {
+            uint32_t addr = sim_reg(&sim->dma.conblk_ad);
+
+            if (!sim->active_ns || (t < sim->active_ns) || !addr || sim_cb_load(sim, addr))
+            {
+                return;
+            }
+
+            // Written along with ACTIVE INT and END clear the flags of the last transfer
+            sim_reg_update(&sim->dma.cs, RPI_DMA_CS_INT | RPI_DMA_CS_END, 0);
+
+            sim->dma_dest = sim->dma.dest_ad;
+            sim->dma_left = sim->dma.txfr_len;
+            sim->start_ns = sim->active_ns;
+            sim->active_ns = 0;
+            sim->first_word_ns = 0;
+            sim->end_ns = 0;
+            sim->drain_ns = 0;
+        }
+
+        fifo = sim_dma_fifo(sim, sim->dma_dest, &threshold);
+        if (!fifo)
+        {
+            sim->dma_left = 0;
+        }
+        else if (sim->dma_left)
+        {
+            if (*fifo >= threshold)
+            {
+                return;
+            }
+
+            words = threshold - *fifo;
+            if (words > (sim->dma_left + 3) / 4)
+            {
+                words = (sim->dma_left + 3) / 4;
+            }
+            *fifo += words;
+            sim->dma_left -= (words * 4 < sim->dma_left) ? words * 4 : sim->dma_left;
+
+            if (sim->dma_left)
+            {
+                return;
+            }
+        }
+
+        // Control block done, go on with the next one or stop
+        sim->transfers++;
+        if (sim->dma.nextconbk)
+        {
+            if (sim_cb_load(sim, sim->dma.nextconbk))
+            {
+                sim->dma_dest = 0;
+                return;
+            }
+            sim->dma_dest = sim->dma.dest_ad;
+            sim->dma_left = sim->dma.txfr_len;
+            continue;
+        }
+
+        sim->dma_dest = 0;
+        sim->end_ns = t;
+        __atomic_store_n(&sim->dma.conblk_ad, 0, __ATOMIC_RELEASE);
+        sim_reg_update(&sim->dma.cs, RPI_DMA_CS_ACTIVE, RPI_DMA_CS_END);
+        return;
+    }
+}
+
+/**
+ * Advance the clock manager, the DMA and the serializer of whichever peripheral is enabled to
+ * time now.  The serializer takes a word from the FIFO every word period, PWM alternating
+ * between its enabled channels, and the DMA refills the FIFO just before.
+ *
+ * @param    sim  Simulator.
+ * @param    now  Current time.
+ *
+ * @returns  None
+ */
+static void sim_step(sim_t *sim, uint64_t now)
+{
+    uint32_t ctl = sim_reg(&sim->cm_clk.ctl);
+    uint32_t divi = (sim_reg(&sim->cm_clk.div) >> 12) & 0xfff;
+    uint32_t pwm_ctl = sim_reg(&sim->pwm.ctl);
+    uint32_t pcm_cs = sim_reg(&sim->pcm.cs);
+    uint32_t dma_cs = sim_reg(&sim->dma.cs);
+    uint32_t *fifo = NULL;
+    uint32_t bits = 0, channels = 1;
+    uint64_t word_ps;
+
+    // Clock manager, busy follows enable
+    if ((ctl & CM_CLK_CTL_ENAB) && !(ctl & CM_CLK_CTL_KILL))
+    {
+        if (!(ctl & CM_CLK_CTL_BUSY))
+        {
+            sim_reg_update(&sim->cm_clk.ctl, 0, CM_CLK_CTL_BUSY);
+        }
+        if (!sim->clock_on_ns)
+        {
+            sim->clock_on_ns = now;
+        }
+    }
+    else
+    {
+        if (ctl & CM_CLK_CTL_BUSY)
+        {
+            sim_reg_update(&sim->cm_clk.ctl, CM_CLK_CTL_BUSY, 0);
+        }
+        sim->clock_on_ns = 0;
+    }
+
+    // A reset aborts the transfer and clears the channel, the bit clears itself
+    if (dma_cs & RPI_DMA_CS_RESET)
+    {
+        sim->dma_dest = 0;
+        sim->dma_left = 0;
+        sim->active_ns = 0;
+        sim_reg_update(&sim->dma.cs, 0xffffffff, 0);
+    }
+    else if ((dma_cs & RPI_DMA_CS_ACTIVE) && !sim->dma_dest && !sim->active_ns)
+    {
+        sim->active_ns = now;
+    }
+
+    // Self clearing FIFO clears
+    if (pwm_ctl & RPI_PWM_CTL_CLRF1)
+    {
+        sim->pwm_fifo = 0;
+        sim_reg_update(&sim->pwm.ctl, RPI_PWM_CTL_CLRF1, 0);
+    }
+    if (pcm_cs & RPI_PCM_CS_TXCLR)
+    {
+        sim->pcm_fifo = 0;
+        sim_reg_update(&sim->pcm.cs, RPI_PCM_CS_TXCLR, 0);
+    }
+
+    if (pwm_ctl & (RPI_PWM_CTL_PWEN1 | RPI_PWM_CTL_PWEN2))
+    {
+        fifo = &sim->pwm_fifo;
+        bits = sim_reg(&sim->pwm.rng1);
+        channels = !!(pwm_ctl & RPI_PWM_CTL_PWEN1) + !!(pwm_ctl & RPI_PWM_CTL_PWEN2);
+    }
+    else if ((pcm_cs & RPI_PCM_CS_EN) && (pcm_cs & RPI_PCM_CS_TXON))
+    {
+        fifo = &sim->pcm_fifo;
+        bits = ((sim_reg(&sim->pcm.mode) >> 10) & 0x3ff) + 1;
+    }
+
+    if (!fifo || !bits || !divi || !sim->clock_on_ns)
+    {
+        sim->next_word_ns = 0;
+        sim_dma_fill(sim, now);
+    }
+    else
+    {
+        word_ps = ((uint64_t)bits * divi * 1000000000000ULL) / SIM_OSC_FREQ / channels;
+
+        // The serializer takes its first word as soon as it is enabled
+        if (!sim->next_word_ns)
+        {
+            sim->serial_on_ns = now;
+            sim->next_word_ns = now;
+            sim->word_slot = 0;
+        }
+
+        while (sim->next_word_ns <= now)
+        {
+            uint64_t t = sim->next_word_ns;
+
+            sim_dma_fill(sim, t);
+
+            if (*fifo)
+            {
+                (*fifo)--;
+                sim->words_sent++;
+                if (sim->start_ns && !sim->first_word_ns)
+                {
+                    sim->first_word_ns = t;
+                }
+                if (!*fifo && !sim->dma_dest && sim->end_ns && !sim->drain_ns)
+                {
+                    sim->drain_ns = t + (word_ps * channels) / 1000;
+                }
+            }
+            else if (sim->dma_dest)
+            {
+                sim->underruns++;
+                if (fifo == &sim->pcm_fifo)
+                {
+                    sim_reg_update(&sim->pcm.cs, 0, RPI_PCM_CS_TXERR);
+                }
+            }
+
+            sim->word_slot++;
+            sim->next_word_ns = sim->serial_on_ns + (sim->word_slot * word_ps) / 1000;
+        }
+    }
+
+    // FIFO status
+    sim_reg_update(&sim->pwm.sta, RPI_PWM_STA_EMPT1 | RPI_PWM_STA_FULL1,
+                   (!sim->pwm_fifo ? RPI_PWM_STA_EMPT1 : 0) |
+                   ((sim->pwm_fifo >= SIM_PWM_FIFO_WORDS) ? RPI_PWM_STA_FULL1 : 0));
+    if ((!sim->pcm_fifo) != !!(pcm_cs & RPI_PCM_CS_TXE))
+    {
+        sim_reg_update(&sim->pcm.cs, RPI_PCM_CS_TXE, !sim->pcm_fifo ? RPI_PCM_CS_TXE : 0);
+    }
+}
+
+static void *sim_thread(void *arg)
+{
+    sim_t *sim = arg;
+
+    while (sim->running)
+    {
+        sim_step(sim, monotonic_ns());
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+/**
+ * Switch from instant transfers to the timed model, run on a thread until sim_destroy().
+ * Call before the driver touches any register.
+ *
+ * @param    sim  Simulator.
+ *
+ * @returns  0 on success, -1 if the thread cannot be started.
+ */
+int sim_start(sim_t *sim)
+{
+    sim->mode = SIM_TIMED;
+    sim->running = 1;
+
+    if (pthread_create(&sim->thread, NULL, sim_thread, sim))
+    {
+        sim->mode = SIM_INSTANT;
+        sim->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * sim.h
+ *
+ * Copyright (c) 2014 Jeremy Garff <jer @ jers.net>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     1.  Redistributions of source code must retain the above copyright notice, this list of
+ *         conditions and the following disclaimer.
+ *     2.  Redistributions in binary form must reproduce the above copyright notice, this list
+ *         of conditions and the following disclaimer in the documentation and/or other materials
+ *         provided with the distribution.
+ *     3.  Neither the name of the owner nor the names of its contributors may be used to endorse
+ *         or promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dma.h"
+#include "pwm.h"
+#include "pcm.h"
+#include "gpio.h"
+#include "clk.h"
+
+
+#define SIM_OSC_FREQ                             19200000   // Oscillator the PWM/PCM clock divides
+#define SIM_PWM_FIFO_WORDS                       16
+#define SIM_PCM_FIFO_WORDS                       64
+
+// How the peripherals behave, see sim_start()
+#define SIM_INSTANT                              1   // DMA transfers complete as soon as they start
+#define SIM_TIMED                                2   // Peripherals run in real time on a thread
+
+/*
+ * Peripheral registers and VideoCore memory backed by ordinary memory, so the driver can run
+ * without a Pi.  By default DMA transfers complete as soon as they are started.
+ *
+ * Once sim_start() has been called a thread models the clock manager, the PWM and PCM FIFOs
+ * and the DMA controller instead: the clock reports busy once enabled, the DMA walks the
+ * control block chain feeding the FIFO of its destination as DREQ allows, and the FIFO drains
+ * at the configured bit clock, OSC / DIVI.  DMA transfers are modelled as instantaneous
+ * against the bit clock.  The thread polls the registers continuously and keeps a CPU busy.
+ * Times are CLOCK_MONOTONIC nanoseconds of the model, accurate to the bit clock, while the
+ * registers follow with the latency of the polling.
+ */
+typedef struct sim
+{
+    dma_t dma;
+    pwm_t pwm;
+    pcm_t pcm;
+    gpio_t gpio;
+    cm_clk_t cm_clk;
+    uint8_t *mem;                                //< Stands in for the mailbox allocation
+    uint32_t mem_bus;                            //< Bus address of mem
+    uint32_t mem_size;                           //< Size of mem in bytes
+    uint32_t transfers;                          //< DMA control blocks run so far
+    uint32_t last_conblk_ad;                     //< Bus address of the last control block run
+    uint8_t *frame;                              //< Copy of the data sent by the last transfer
+    uint32_t frame_len;                          //< Bytes in frame
+
+    // Timed model only
+    int mode;                                    //< SIM_INSTANT or SIM_TIMED
+    pthread_t thread;
+    volatile int running;
+    uint32_t pwm_fifo;                           //< Words in the PWM FIFO
+    uint32_t pcm_fifo;                           //< Words in the PCM FIFO
+    uint32_t dma_left;                           //< Bytes of the current control block still to move
+    uint32_t dma_dest;                           //< Destination of the current control block
+    uint64_t clock_on_ns;                        //< Bit clock started, 0 while stopped
+    uint64_t serial_on_ns;                       //< Serializer enabled, 0 while stopped
+    uint64_t word_slot;                          //< Words the serializer took since
+    uint64_t next_word_ns;                       //< Next time the serializer takes a word
+    uint64_t active_ns;                          //< DMA activation seen, chain not loaded yet
+    uint64_t start_ns;                           //< DMA of the last transfer started
+    uint64_t first_word_ns;                      //< First word of it left the FIFO
+    uint64_t end_ns;                             //< DMA wrote its last word, END set
+    uint64_t drain_ns;                           //< Its last bit left the serializer
+    uint32_t words_sent;                         //< Words taken by the serializer
+    uint32_t underruns;                          //< FIFO ran empty while the DMA was still active
+} sim_t;
+
+sim_t *sim_create(uint32_t mem_size);            //< Allocate registers and memory
+void sim_destroy(sim_t *sim);                    //< Free it all again
+int sim_start(sim_t *sim);                       //< Run the timed model, 0 on success
+void sim_dma_run(sim_t *sim);                    //< Run the transfer started through sim->dma
+
+#endif /* __SIM_H__ */
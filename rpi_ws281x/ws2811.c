@@ -28,6 +28,7 @@
  */
 
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,6 +41,8 @@
 #include <signal.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
+#include <sys/timerfd.h>
+#include <arpa/inet.h>
 #include <time.h>
 
 #include "mailbox.h"
@@ -51,39 +54,47 @@
 #include "rpihw.h"
 
 #include "ws2811.h"
+#include "encode.h"
+#include "decode.h"
+#include "sim.h"
+#include "monotonic.h"
 
 
 #define BUS_TO_PHYS(x)                           ((x)&~0xC0000000)
 
 #define OSC_FREQ                                 19200000   // crystal frequency
 
-/* 4 colors (R, G, B + W), 8 bits per byte, 3 symbols per bit + 55uS low for reset signal */
-#define LED_COLOURS                              4
+/* Colour bytes (3 or 4 per LED), 8 bits per byte, 3 symbols per bit + 55uS low for reset signal */
 #define LED_RESET_uS                             55
-#define LED_BIT_COUNT(leds, freq)                ((leds * LED_COLOURS * 8 * 3) + ((LED_RESET_uS * \
+#define LED_BIT_COUNT(bytes, freq)               ((bytes * 8 * 3) + ((LED_RESET_uS * \
                                                   (freq * 3)) / 1000000))
 
 /* Minimum time to wait for reset to occur in microseconds. */
 #define LED_RESET_WAIT_TIME                      300
 
 // Pad out to the nearest uint32 + 32-bits for idle low/high times the number of channels
-#define PWM_BYTE_COUNT(leds, freq)               (((((LED_BIT_COUNT(leds, freq) >> 3) & ~0x7) + 4) + 4) * \
+#define PWM_BYTE_COUNT(bytes, freq)              (((((LED_BIT_COUNT(bytes, freq) >> 3) & ~0x7) + 4) + 4) * \
                                                   RPI_PWM_CHANNELS)
-#define PCM_BYTE_COUNT(leds, freq)               ((((LED_BIT_COUNT(leds, freq) >> 3) & ~0x7) + 4) + 4)
-
-// Symbol definitions
-#define SYMBOL_HIGH                              0x6  // 1 1 0
-#define SYMBOL_LOW                               0x4  // 1 0 0
-
-// Symbol definitions for software inversion (PCM and SPI only)
-#define SYMBOL_HIGH_INV                          0x1  // 0 0 1
-#define SYMBOL_LOW_INV                           0x3  // 0 1 1
+#define PCM_BYTE_COUNT(bytes, freq)              ((((LED_BIT_COUNT(bytes, freq) >> 3) & ~0x7) + 4) + 4)
 
 // Driver mode definitions
 #define NONE	0
-#define PWM	1
-#define PCM	2
-#define SPI	3
+#define PWM	WS2811_DRIVER_PWM
+#define PCM	WS2811_DRIVER_PCM
+#define SPI	WS2811_DRIVER_SPI
+
+// Pixel buffers for PWM and PCM, one is encoded while the other is sent
+#define DMA_BUFFERS                              2
+
+// Encoder threads, a channel is only split up if every piece gets at least ENCODE_CHUNK_LEDS
+#define ENCODE_WORKERS_MAX                       16
+#define ENCODE_CHUNK_LEDS                        256
+#define ENCODE_JOBS_MAX                          (RPI_PWM_CHANNELS * (ENCODE_WORKERS_MAX + 1))
+
+// Changed LEDs are re-encoded in at most ENCODE_RANGES_MAX ranges per channel, runs of fewer
+// than ENCODE_RANGE_GAP unchanged LEDs between them are re-encoded rather than skipped
+#define ENCODE_RANGES_MAX                        16
+#define ENCODE_RANGE_GAP                         16
 
 // We use the mailbox interface to request memory from the VideoCore.
 // This lets us request one physically contiguous chunk, find its
@@ -98,22 +109,72 @@ typedef struct videocore_mbox {
     uint8_t *virt_addr;     /* From mapmem() */
 } videocore_mbox_t;
 
+struct ws2811_backend;
+
 typedef struct ws2811_device
 {
+    const struct ws2811_backend *backend;        //< Output the frames are sent through
     int driver_mode;
     volatile uint8_t *pxl_raw;
     volatile dma_t *dma;
     volatile pwm_t *pwm;
     volatile pcm_t *pcm;
     int spi_fd;
+    uint8_t spi_mode;                            //< SPI mode as set up on spi_fd
+    uint8_t spi_bits;                            //< SPI bits per word as set up on spi_fd
+    uint32_t spi_speed;                          //< SPI clock in Hz as set up on spi_fd
     volatile dma_cb_t *dma_cb;
     uint32_t dma_cb_addr;
     volatile gpio_t *gpio;
     volatile cm_clk_t *cm_clk;
     videocore_mbox_t mbox;
-    int max_count;
+    int max_bytes;                               //< Colour bytes of the longest channel
+    encode_render_t encode[RPI_PWM_CHANNELS];
+    volatile uint8_t *pxl_buf[DMA_BUFFERS];      //< DMA pixel buffers, pxl_raw is the idle one
+    volatile dma_cb_t *dma_cbs[DMA_BUFFERS];     //< Control block sending each pixel buffer
+    int buffer;                                  //< Index of the idle buffer
+    int dma_ready;                               //< DMA channel configured and idle, no reset needed
+    sim_t *sim;                                  //< Simulated registers, NULL on hardware
+    uint32_t *pxl_stage;                         //< Cached buffer the frame is encoded into
+    size_t pxl_size;                             //< Size of pxl_raw and pxl_stage in bytes
+    ws2811_stats_t stats;
+    uint64_t sent_at;                            //< Time in ns the last frame is fully sent
+    uint64_t done_at;                            //< Time in ns the last frame sent incl. reset is over
+    uint64_t render_at;                          //< Time in ns the frame being started was rendered
+    int async_fd;                                //< timerfd signalling completion, -1 until requested
+    int async_queued;                            //< Frame waiting in the idle buffer
+    uint32_t async_protocol_time;                //< Protocol time of the queued frame in µs
+    uint8_t lut[RPI_PWM_CHANNELS][256];          //< Brightness and gamma combined, per channel
+    uint8_t lut_gamma[RPI_PWM_CHANNELS][256];    //< Gamma table lut was built from
+    int lut_brightness[RPI_PWM_CHANNELS];        //< Brightness lut was built for, -1 if not built
+    ws2811_led_t *shadow[RPI_PWM_CHANNELS];      //< LEDs as last encoded into pxl_stage
+    int shadow_valid[RPI_PWM_CHANNELS];          //< pxl_stage matches shadow and the current lut
+    encode_pool_t *pool;                         //< Encoder threads, NULL to encode inline
+    int workers;                                 //< Threads in pool
+    encode_job_t jobs[ENCODE_JOBS_MAX];
+    int tx_end[RPI_PWM_CHANNELS];                //< LED after the last one changed since the last transfer
+    int tx_bits[RPI_PWM_CHANNELS];               //< Symbol bits of each channel the next transfer sends
+    size_t tx_size;                              //< Bytes of pxl_raw the next transfer sends
+    uint8_t *spi_reset;                          //< Zeros sent after a shortened SPI frame
+    uint8_t *mem_frame;                          //< Last frame sent to the memory backend
+    size_t mem_frame_len;                        //< Bytes in mem_frame
+    int mem_instant;                             //< Memory backend frames take no time to send
 } ws2811_device_t;
 
+/*
+ * Output backend.  The encoder fills pxl_raw, the backend gets the frame to the LEDs.  The
+ * PWM and PCM hardware share the DMA backend, SPI has its own, and the simulator and the
+ * memory backend let the driver run anywhere.
+ */
+typedef struct ws2811_backend
+{
+    ws2811_return_t (*init)(ws2811_t *ws2811);   //< Set up the output and the buffers it sends from
+    ws2811_return_t (*submit)(ws2811_t *ws2811); //< Start sending tx_size bytes of pxl_raw
+    int (*busy)(ws2811_t *ws2811);               //< 1 while sending, 0 when done, < 0 on error
+    ws2811_return_t (*wait)(ws2811_t *ws2811);   //< Wait for the transfer to finish
+    void (*fini)(ws2811_t *ws2811);              //< Stop the output, before ws2811_cleanup()
+} ws2811_backend_t;
+
 /**
  * Provides monotonic timestamp in microseconds.
  *
@@ -131,27 +192,240 @@ uint64_t get_microsecond_timestamp()
 }
 
 /**
- * Iterate through the channels and find the largest led count.
+ * Number of colours per LED of a channel.  Strip types without a white shift are RGB,
+ * including the unset strip type which defaults to WS2811_STRIP_RGB.
+ *
+ * @param    channel  Channel to look at.
+ *
+ * @returns  3 or 4.
+ */
+static int channel_colours(ws2811_channel_t *channel)
+{
+    return (channel->strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+}
+
+/**
+ * Find the longest channel in colour bytes.  This sizes the DMA buffers, so an RGB strip
+ * only pays for the three colours it actually has.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
- * @returns  Maximum number of LEDs in all channels.
+ * @returns  Number of colour bytes sent on the longest channel.
  */
-static int max_channel_led_count(ws2811_t *ws2811)
+static int max_channel_byte_count(ws2811_t *ws2811)
 {
     int chan, max = 0;
 
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-        if (ws2811->channel[chan].count > max)
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        int bytes = channel->count * channel_colours(channel);
+
+        if (bytes > max)
         {
-            max = ws2811->channel[chan].count;
+            max = bytes;
         }
     }
 
     return max;
 }
 
+/**
+ * Allocate the cached staging buffer the frame is encoded into.  The DMA buffer is mapped
+ * uncached, so it is only ever written with one bulk copy per frame.  SPI already transmits
+ * from normal memory and encodes in place.  Also allocates the shadow copies of the LEDs the
+ * staging buffer was encoded from.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    size    Size of pxl_raw in bytes.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static int stage_init(ws2811_t *ws2811, size_t size)
+{
+    ws2811_device_t *device = ws2811->device;
+    int chan;
+
+    device->pxl_size = size;
+
+    // The staging buffer persists, so only LEDs that differ from what it holds are encoded
+    device->tx_size = size;
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        device->tx_end[chan] = 0;
+        device->tx_bits[chan] = 0;
+        device->shadow_valid[chan] = 0;
+        device->shadow[chan] = NULL;
+        if (ws2811->channel[chan].count)
+        {
+            device->shadow[chan] = malloc(sizeof(ws2811_led_t) * ws2811->channel[chan].count);
+            if (!device->shadow[chan])
+            {
+                return -1;
+            }
+        }
+    }
+
+    if (device->driver_mode == SPI)
+    {
+        device->pxl_stage = (uint32_t *)device->pxl_raw;
+        return 0;
+    }
+
+    if (posix_memalign((void **)&device->pxl_stage, 64, size))
+    {
+        device->pxl_stage = NULL;
+        return -1;
+    }
+    memset(device->pxl_stage, 0, size);
+
+    return 0;
+}
+
+/**
+ * Work out how much of the frame the next transfer has to send.  LEDs keep their colour
+ * when a frame ends early, so everything after the last LED changed since the previous
+ * transfer is left out and the reset follows right away.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    bitpos  Bit position each channel starts at in its first word.
+ *
+ * @returns  None
+ */
+static void tx_measure(ws2811_t *ws2811, const int bitpos[RPI_PWM_CHANNELS])
+{
+    ws2811_device_t *device = ws2811->device;
+    const int stride = (device->driver_mode == PWM) ? RPI_PWM_CHANNELS : 1;
+    int chan, words = 0;
+    size_t size;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        int bits = 0;
+
+        if (device->tx_end[chan])
+        {
+            bits = (31 - bitpos[chan]) +
+                   device->tx_end[chan] * channel_colours(channel) * ENCODE_SYMBOL_BITS;
+        }
+        device->tx_bits[chan] = bits;
+
+        if ((bits + 31) / 32 > words)
+        {
+            words = (bits + 31) / 32;
+        }
+    }
+
+    // Whole 8 byte units for stage_copy(), then at least the reset time of zeros
+    size = ((((words + 1) & ~1) * sizeof(uint32_t)) + PCM_BYTE_COUNT(0, ws2811->freq)) * stride;
+    device->tx_size = (size < device->pxl_size) ? size : device->pxl_size;
+}
+
+/**
+ * Clear everything of a shortened frame after the last LED it sends, including the rest of
+ * the LED the last word ends in.
+ *
+ * @param    device  Device.
+ * @param    words   Buffer to clear, laid out like pxl_raw.
+ *
+ * @returns  None
+ */
+static void tx_trim(ws2811_device_t *device, volatile uint32_t *words)
+{
+    const int stride = (device->driver_mode == PWM) ? RPI_PWM_CHANNELS : 1;
+    const int count = device->tx_size / sizeof(uint32_t) / stride;
+    int chan, i;
+
+    for (chan = 0; chan < stride; chan++)
+    {
+        int bits = device->tx_bits[chan];
+        int used = (bits + 31) / 32;
+        uint32_t mask = ~(0xffffffff >> (bits % 32));
+
+        if (bits % 32)
+        {
+            // SPI words are stored in wire order
+            words[(used - 1) * stride + chan] &= (device->driver_mode == SPI) ? htonl(mask) : mask;
+        }
+        for (i = used; i < count; i++)
+        {
+            words[i * stride + chan] = 0;
+        }
+    }
+}
+
+/**
+ * Copy the part of the staging buffer the next transfer sends into the DMA buffer.  Both
+ * buffers are 8 byte aligned and the copy a multiple of 8 bytes long, which keeps every store
+ * to the uncached mapping a whole aligned word.
+ *
+ * @param    device  Device to copy for.
+ *
+ * @returns  None
+ */
+static void stage_copy(ws2811_device_t *device)
+{
+    uint64_t *dst = (uint64_t *)device->pxl_raw;
+    const uint64_t *src = (const uint64_t *)device->pxl_stage;
+    size_t i, count = device->tx_size / sizeof(uint64_t);
+
+    for (i = 0; i < count; i++)
+    {
+        dst[i] = src[i];
+    }
+
+    if (device->tx_size < device->pxl_size)
+    {
+        tx_trim(device, (volatile uint32_t *)dst);
+    }
+
+    // Make sure the data is out before the DMA is started
+    __sync_synchronize();
+}
+
+/**
+ * Output buffer layout of the device.
+ *
+ * @param    device  Device.
+ *
+ * @returns  One of ENCODE_LAYOUT_xxx.
+ */
+static int driver_layout(ws2811_device_t *device)
+{
+    switch (device->driver_mode)
+    {
+    case PWM:
+        return ENCODE_LAYOUT_PWM;
+    case SPI:
+        return ENCODE_LAYOUT_SPI;
+    default:
+        return ENCODE_LAYOUT_PCM;
+    }
+}
+
+/**
+ * Pick the encoder for each channel from the driver mode, inversion and strip type.  Must be
+ * called once the strip types are final.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void select_encoders(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int chan;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+
+        device->encode[chan] = encode_get_render(driver_layout(device), channel->invert,
+                                                 channel_colours(channel));
+    }
+}
+
 /**
  * Map all devices into userspace memory.
  * Not called for SPI
@@ -238,6 +512,11 @@ static void unmap_registers(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
 
+    if (device->sim)
+    {
+        return;
+    }
+
     if (device->dma)
     {
         unmapmem((void *)device->dma, sizeof(dma_t));
@@ -281,6 +560,22 @@ static uint32_t addr_to_bus(ws2811_device_t *device, const volatile void *virt)
     return mbox->bus_addr + offset;
 }
 
+/**
+ * Make one of the DMA pixel buffers the one the next frame is written to and sent from.
+ *
+ * @param    device  Device.
+ * @param    buffer  Buffer index.
+ *
+ * @returns  None
+ */
+static void select_buffer(ws2811_device_t *device, int buffer)
+{
+    device->buffer = buffer;
+    device->pxl_raw = device->pxl_buf[buffer];
+    device->dma_cb = device->dma_cbs[buffer];
+    device->dma_cb_addr = addr_to_bus(device, device->dma_cb);
+}
+
 /**
  * Stop the PWM controller.
  *
@@ -339,13 +634,9 @@ static void stop_pcm(ws2811_t *ws2811)
 static int setup_pwm(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
-    volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
     volatile pwm_t *pwm = device->pwm;
     volatile cm_clk_t *cm_clk = device->cm_clk;
-    int maxcount = device->max_count;
     uint32_t freq = ws2811->freq;
-    int32_t byte_count;
 
     stop_pwm(ws2811);
 
@@ -382,24 +673,6 @@ static int setup_pwm(ws2811_t *ws2811)
     usleep(10);
     pwm->ctl |= RPI_PWM_CTL_PWEN1 | RPI_PWM_CTL_PWEN2;
 
-    // Initialize the DMA control block
-    byte_count = PWM_BYTE_COUNT(maxcount, freq);
-    dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                 RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                 RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                 RPI_DMA_TI_PERMAP(5) |       // PWM peripheral
-                 RPI_DMA_TI_SRC_INC;          // Increment src addr
-
-    dma_cb->source_ad = addr_to_bus(device, device->pxl_raw);
-
-    dma_cb->dest_ad = (uint32_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1;
-    dma_cb->txfr_len = byte_count;
-    dma_cb->stride = 0;
-    dma_cb->nextconbk = 0;
-
-    dma->cs = 0;
-    dma->txfr_len = 0;
-
     return 0;
 }
 
@@ -413,14 +686,9 @@ static int setup_pwm(ws2811_t *ws2811)
 static int setup_pcm(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
-    volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
     volatile pcm_t *pcm = device->pcm;
     volatile cm_clk_t *cm_clk = device->cm_clk;
-    //int maxcount = max_channel_led_count(ws2811);
-    int maxcount = device->max_count;
     uint32_t freq = ws2811->freq;
-    int32_t byte_count;
 
     stop_pcm(ws2811);
 
@@ -448,29 +716,69 @@ static int setup_pcm(ws2811_t *ws2811)
     pcm->cs |= RPI_PCM_CS_DMAEN;         // Enable DMA DREQ
     pcm->dreq = (RPI_PCM_DREQ_TX(0x3F) | RPI_PCM_DREQ_TX_PANIC(0x10)); // Set FIFO tresholds
 
-    // Initialize the DMA control block
-    byte_count = PCM_BYTE_COUNT(maxcount, freq);
-    dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                 RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                 RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                 RPI_DMA_TI_PERMAP(2) |       // PCM TX peripheral
-                 RPI_DMA_TI_SRC_INC;          // Increment src addr
+    return 0;
+}
+
+/**
+ * Initialize the DMA control block of each pixel buffer.  They only differ in the buffer
+ * they send from.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void setup_dma(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile dma_t *dma = device->dma;
+    int maxbytes = device->max_bytes;
+    uint32_t freq = ws2811->freq;
+    uint32_t permap, dest_ad;
+    int32_t byte_count;
+    int i;
+
+    if (device->driver_mode == PWM)
+    {
+        byte_count = PWM_BYTE_COUNT(maxbytes, freq);
+        permap = 5;                           // PWM peripheral
+        dest_ad = (uint32_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1;
+    }
+    else
+    {
+        byte_count = PCM_BYTE_COUNT(maxbytes, freq);
+        permap = 2;                           // PCM TX peripheral
+        dest_ad = (uint32_t)&((pcm_t *)PCM_PERIPH_PHYS)->fifo;
+    }
+
+    for (i = 0; i < DMA_BUFFERS; i++)
+    {
+        volatile dma_cb_t *dma_cb = device->dma_cbs[i];
+
+        memset((dma_cb_t *)dma_cb, 0, sizeof(dma_cb_t));
 
-    dma_cb->source_ad = addr_to_bus(device, device->pxl_raw);
-    dma_cb->dest_ad = (uint32_t)&((pcm_t *)PCM_PERIPH_PHYS)->fifo;
-    dma_cb->txfr_len = byte_count;
-    dma_cb->stride = 0;
-    dma_cb->nextconbk = 0;
+        dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
+                     RPI_DMA_TI_WAIT_RESP |       // wait for write complete
+                     RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
+                     RPI_DMA_TI_PERMAP(permap) |
+                     RPI_DMA_TI_SRC_INC;          // Increment src addr
+
+        dma_cb->source_ad = addr_to_bus(device, device->pxl_buf[i]);
+        dma_cb->dest_ad = dest_ad;
+        dma_cb->txfr_len = byte_count;
+        dma_cb->stride = 0;
+        dma_cb->nextconbk = 0;
+    }
 
     dma->cs = 0;
     dma->txfr_len = 0;
-
-    return 0;
+    device->dma_ready = 0;
 }
 
 /**
  * Start the DMA feeding the PWM FIFO.  This will stream the entire DMA buffer out of both
- * PWM channels.
+ * PWM channels.  The channel is reset on the first start and after an error.  Otherwise it
+ * finished the last frame cleanly and only needs the next control block: the sleeps the
+ * reset takes would delay every frame by far more than the transfer set up itself.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
@@ -482,24 +790,44 @@ void dma_start(ws2811_t *ws2811)
     volatile dma_t *dma = device->dma;
     volatile pcm_t *pcm = device->pcm;
     uint32_t dma_cb_addr = device->dma_cb_addr;
+    const uint32_t cs = RPI_DMA_CS_WAIT_OUTSTANDING_WRITES |
+                        RPI_DMA_CS_PANIC_PRIORITY(15) |
+                        RPI_DMA_CS_PRIORITY(15) |
+                        RPI_DMA_CS_ACTIVE;
 
-    dma->cs = RPI_DMA_CS_RESET;
-    usleep(10);
+    if (device->dma_ready && !(dma->cs & (RPI_DMA_CS_ACTIVE | RPI_DMA_CS_ERROR)))
+    {
+        // INT and END are write 1 to clear, the last frame left them set
+        dma->conblk_ad = dma_cb_addr;
+        dma->cs = cs | RPI_DMA_CS_INT | RPI_DMA_CS_END;
+        device->stats.fast_starts++;
+    }
+    else
+    {
+        dma->cs = RPI_DMA_CS_RESET;
+        usleep(10);
 
-    dma->cs = RPI_DMA_CS_INT | RPI_DMA_CS_END;
-    usleep(10);
+        dma->cs = RPI_DMA_CS_INT | RPI_DMA_CS_END;
+        usleep(10);
 
-    dma->conblk_ad = dma_cb_addr;
-    dma->debug = 7; // clear debug error flags
-    dma->cs = RPI_DMA_CS_WAIT_OUTSTANDING_WRITES |
-              RPI_DMA_CS_PANIC_PRIORITY(15) |
-              RPI_DMA_CS_PRIORITY(15) |
-              RPI_DMA_CS_ACTIVE;
+        dma->conblk_ad = dma_cb_addr;
+        dma->debug = 7; // clear debug error flags
+        dma->cs = cs;
+        device->dma_ready = 1;
+    }
 
     if (device->driver_mode == PCM)
     {
         pcm->cs |= RPI_PCM_CS_TXON;  // Start transmission
     }
+
+    if (device->sim)
+    {
+        sim_dma_run(device->sim);
+    }
+
+    // The buffer just started belongs to the DMA now, the next frame goes into the other one
+    select_buffer(device, device->buffer ^ 1);
 }
 
 /**
@@ -557,8 +885,8 @@ static int gpio_init(ws2811_t *ws2811)
 void pwm_raw_init(ws2811_t *ws2811)
 {
     volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
-    int maxcount = ws2811->device->max_count;
-    int wordcount = (PWM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t)) /
+    int maxbytes = ws2811->device->max_bytes;
+    int wordcount = (PWM_BYTE_COUNT(maxbytes, ws2811->freq) / sizeof(uint32_t)) /
                     RPI_PWM_CHANNELS;
     int chan;
 
@@ -585,8 +913,8 @@ void pwm_raw_init(ws2811_t *ws2811)
 void pcm_raw_init(ws2811_t *ws2811)
 {
     volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
-    int maxcount = ws2811->device->max_count;
-    int wordcount = PCM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t);
+    int maxbytes = ws2811->device->max_bytes;
+    int wordcount = PCM_BYTE_COUNT(maxbytes, ws2811->freq) / sizeof(uint32_t);
     int i;
 
     for (i = 0; i < wordcount; i++)
@@ -621,6 +949,18 @@ void ws2811_cleanup(ws2811_t *ws2811)
         ws2811->channel[chan].gamma = NULL;
     }
 
+    if (device->pxl_stage && (device->pxl_stage != (uint32_t *)device->pxl_raw))
+    {
+        free(device->pxl_stage);
+    }
+    device->pxl_stage = NULL;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        free(device->shadow[chan]);
+        device->shadow[chan] = NULL;
+    }
+
     if (device->mbox.handle != -1)
     {
         videocore_mbox_t *mbox = &device->mbox;
@@ -633,11 +973,28 @@ void ws2811_cleanup(ws2811_t *ws2811)
         mbox->handle = -1;
     }
 
+    sim_destroy(device->sim);
+    device->sim = NULL;
+
+    encode_pool_destroy(device->pool);
+    device->pool = NULL;
+
+    free(device->spi_reset);
+    device->spi_reset = NULL;
+
+    free(device->mem_frame);
+    device->mem_frame = NULL;
+
     if (device && (device->spi_fd > 0))
     {
         close(device->spi_fd);
     }
 
+    if (device && (device->async_fd >= 0))
+    {
+        close(device->async_fd);
+    }
+
     if (device) {
         free(device);
     }
@@ -732,55 +1089,115 @@ static int check_hwver_and_gpionum(ws2811_t *ws2811)
     return -1;
 }
 
-static ws2811_return_t spi_init(ws2811_t *ws2811)
+/**
+ * Allocate the LED buffers, fill in the strip type and gamma table defaults and pick the
+ * encoders.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  WS2811_SUCCESS or an error code.
+ */
+static ws2811_return_t channels_init(ws2811_t *ws2811)
 {
-    int spi_fd;
-    static uint8_t mode;
-    static uint8_t bits = 8;
-    uint32_t speed = ws2811->freq * 3;
-    ws2811_device_t *device = ws2811->device;
-    uint32_t base = ws2811->rpi_hw->periph_base;
-    int pinnum = ws2811->channel[0].gpionum;
-
-    spi_fd = open("/dev/spidev0.0", O_RDWR);
-    if (spi_fd < 0) {
-        fprintf(stderr, "Cannot open /dev/spidev0.0. spi_bcm2835 module not loaded?\n");
-        return WS2811_ERROR_SPI_SETUP;
-    }
-    device->spi_fd = spi_fd;
+    int chan;
 
-    // SPI mode
-    if (ioctl(spi_fd, SPI_IOC_WR_MODE, &mode) < 0)
-    {
-        return WS2811_ERROR_SPI_SETUP;
-    }
-    if (ioctl(spi_fd, SPI_IOC_RD_MODE, &mode) < 0)
+    // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-        return WS2811_ERROR_SPI_SETUP;
+        ws2811->channel[chan].leds = NULL;
     }
 
-    // Bits per word
-    if (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0)
-    {
-        return WS2811_ERROR_SPI_SETUP;
-    }
-    if (ioctl(spi_fd, SPI_IOC_RD_BITS_PER_WORD, &bits) < 0)
+    // Allocate the LED buffers
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-        return WS2811_ERROR_SPI_SETUP;
-    }
+        ws2811_channel_t *channel = &ws2811->channel[chan];
 
-    // Max speed Hz
-    if (ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
-    {
-        return WS2811_ERROR_SPI_SETUP;
-    }
-    if (ioctl(spi_fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) < 0)
-    {
-        return WS2811_ERROR_SPI_SETUP;
-    }
+        channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
+        if (!channel->leds)
+        {
+            ws2811_cleanup(ws2811);
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
 
-    // Initialize device structure elements to not used
-    // except driver_mode, spi_fd and max_count (already defined when spi_init called)
+        memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
+
+        if (!channel->strip_type)
+        {
+          channel->strip_type=WS2811_STRIP_RGB;
+        }
+
+        // Set default uncorrected gamma table
+        if (!channel->gamma)
+        {
+          channel->gamma = malloc(sizeof(uint8_t) * 256);
+          int x;
+          for(x = 0; x < 256; x++){
+            channel->gamma[x] = x;
+          }
+        }
+
+        channel->wshift = (channel->strip_type >> 24) & 0xff;
+        channel->rshift = (channel->strip_type >> 16) & 0xff;
+        channel->gshift = (channel->strip_type >> 8)  & 0xff;
+        channel->bshift = (channel->strip_type >> 0)  & 0xff;
+
+    }
+
+    select_encoders(ws2811);
+
+    return WS2811_SUCCESS;
+}
+
+static ws2811_return_t spi_init(ws2811_t *ws2811)
+{
+    int spi_fd;
+    ws2811_return_t ret;
+    ws2811_device_t *device = ws2811->device;
+    uint32_t base = ws2811->rpi_hw->periph_base;
+    int pinnum = ws2811->channel[0].gpionum;
+
+    spi_fd = open("/dev/spidev0.0", O_RDWR);
+    if (spi_fd < 0) {
+        fprintf(stderr, "Cannot open /dev/spidev0.0. spi_bcm2835 module not loaded?\n");
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    device->spi_fd = spi_fd;
+    device->spi_mode = 0;
+    device->spi_bits = 8;
+    device->spi_speed = ws2811->freq * 3;
+
+    // SPI mode
+    if (ioctl(spi_fd, SPI_IOC_WR_MODE, &device->spi_mode) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    if (ioctl(spi_fd, SPI_IOC_RD_MODE, &device->spi_mode) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+
+    // Bits per word
+    if (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &device->spi_bits) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    if (ioctl(spi_fd, SPI_IOC_RD_BITS_PER_WORD, &device->spi_bits) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+
+    // Max speed Hz
+    if (ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &device->spi_speed) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    if (ioctl(spi_fd, SPI_IOC_RD_MAX_SPEED_HZ, &device->spi_speed) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+
+    // Initialize device structure elements to not used
+    // except driver_mode, spi_fd and max_bytes (already defined when spi_init called)
     device->pxl_raw = NULL;
     device->dma = NULL;
     device->pwm = NULL;
@@ -798,58 +1215,83 @@ static ws2811_return_t spi_init(ws2811_t *ws2811)
     }
     gpio_function_set(device->gpio, pinnum, 0);	// SPI-MOSI ALT0
 
-    // Allocate LED buffer
-    ws2811_channel_t *channel = &ws2811->channel[0];
-    channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
-    if (!channel->leds)
+    if ((ret = channels_init(ws2811)) != WS2811_SUCCESS)
     {
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        return ret;
     }
-    memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
-    if (!channel->strip_type)
+
+    // Allocate SPI transmit buffer (same size as PCM)
+    device->pxl_raw = malloc(PCM_BYTE_COUNT(device->max_bytes, ws2811->freq));
+    if (device->pxl_raw == NULL)
     {
-      channel->strip_type=WS2811_STRIP_RGB;
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_OUT_OF_MEMORY;
     }
-
-    // Set default uncorrected gamma table
-    if (!channel->gamma)
+    pcm_raw_init(ws2811);
+    if (stage_init(ws2811, PCM_BYTE_COUNT(device->max_bytes, ws2811->freq)))
     {
-      channel->gamma = malloc(sizeof(uint8_t) * 256);
-      int x;
-      for(x = 0; x < 256; x++){
-        channel->gamma[x] = x;
-      }
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_OUT_OF_MEMORY;
     }
 
-    channel->wshift = (channel->strip_type >> 24) & 0xff;
-    channel->rshift = (channel->strip_type >> 16) & 0xff;
-    channel->gshift = (channel->strip_type >> 8)  & 0xff;
-    channel->bshift = (channel->strip_type >> 0)  & 0xff;
-
-    // Allocate SPI transmit buffer (same size as PCM)
-    device->pxl_raw = malloc(PCM_BYTE_COUNT(device->max_count, ws2811->freq));
-    if (device->pxl_raw == NULL)
+    device->spi_reset = calloc(1, PCM_BYTE_COUNT(0, ws2811->freq));
+    if (device->spi_reset == NULL)
     {
         ws2811_cleanup(ws2811);
         return WS2811_ERROR_OUT_OF_MEMORY;
     }
-    pcm_raw_init(ws2811);
 
     return WS2811_SUCCESS;
 }
 
 ws2811_return_t spi_transfer(ws2811_t *ws2811)
 {
-    int ret;
-    struct spi_ioc_transfer tr;
+    ws2811_device_t *device = ws2811->device;
+    uint32_t *pxl_raw = (uint32_t *)device->pxl_raw;
+    int bits = device->tx_bits[0];
+    int words = (bits + 31) / 32;
+    uint32_t last = 0;
+    int ret, i, n = 0;
+    struct spi_ioc_transfer tr[2];
+
+    memset(tr, 0, sizeof(tr));
+
+    // Another instance may have changed the settings of the bus in the meantime
+    for (i = 0; i < 2; i++)
+    {
+        tr[i].speed_hz = device->spi_speed;
+        tr[i].bits_per_word = device->spi_bits;
+    }
+
+    if (device->tx_size >= device->pxl_size)
+    {
+        tr[n].tx_buf = (unsigned long)pxl_raw;
+        tr[n++].len = device->pxl_size;
+    }
+    else
+    {
+        // pxl_raw is also the staging buffer, so the LED cut off is only masked while sending
+        if (words)
+        {
+            last = pxl_raw[words - 1];
+            if (bits % 32)
+            {
+                pxl_raw[words - 1] &= htonl(~(0xffffffff >> (bits % 32)));
+            }
+            tr[n].tx_buf = (unsigned long)pxl_raw;
+            tr[n++].len = words * sizeof(uint32_t);
+        }
+        tr[n].tx_buf = (unsigned long)device->spi_reset;
+        tr[n++].len = PCM_BYTE_COUNT(0, ws2811->freq);
+    }
 
-    memset(&tr, 0, sizeof(struct spi_ioc_transfer));
-    tr.tx_buf = (unsigned long)ws2811->device->pxl_raw;
-    tr.rx_buf = 0;
-    tr.len = PCM_BYTE_COUNT(ws2811->device->max_count, ws2811->freq);
+    ret = ioctl(device->spi_fd, SPI_IOC_MESSAGE(n), tr);
+
+    if (words && (device->tx_size < device->pxl_size))
+    {
+        pxl_raw[words - 1] = last;
+    }
 
-    ret = ioctl(ws2811->device->spi_fd, SPI_IOC_MESSAGE(1), &tr);
     if (ret < 1)
     {
         fprintf(stderr, "Can't send spi message");
@@ -868,58 +1310,16 @@ ws2811_return_t spi_transfer(ws2811_t *ws2811)
 
 
 /**
- * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO.
+ * Allocate the DMA control blocks and pixel buffers from the VideoCore and map them.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
- * @returns  0 on success, -1 otherwise.
+ * @returns  WS2811_SUCCESS or an error code.
  */
-ws2811_return_t ws2811_init(ws2811_t *ws2811)
+static ws2811_return_t alloc_videocore_mem(ws2811_t *ws2811)
 {
-    ws2811_device_t *device;
-    const rpi_hw_t *rpi_hw;
-    int chan;
-
-    ws2811->rpi_hw = rpi_hw_detect();
-    if (!ws2811->rpi_hw)
-    {
-        return WS2811_ERROR_HW_NOT_SUPPORTED;
-    }
-    rpi_hw = ws2811->rpi_hw;
-
-    ws2811->device = malloc(sizeof(*ws2811->device));
-    if (!ws2811->device)
-    {
-        return WS2811_ERROR_OUT_OF_MEMORY;
-    }
-    device = ws2811->device;
-    device->spi_fd = 0; // XXX - Cleaning up valgrind
-    device->pcm = NULL; // XXX - Cleaning up valgrind
-    if (check_hwver_and_gpionum(ws2811) < 0)
-    {
-        return WS2811_ERROR_ILLEGAL_GPIO;
-    }
-
-    device->max_count = max_channel_led_count(ws2811);
-
-    if (device->driver_mode == SPI) {
-        return spi_init(ws2811);
-    }
-
-    // Determine how much physical memory we need for DMA
-    switch (device->driver_mode) {
-    case PWM:
-        device->mbox.size = PWM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
-        break;
-
-    case PCM:
-        device->mbox.size = PCM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
-        break;
-    }
-    // Round up to page size multiple
-    device->mbox.size = (device->mbox.size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
+    ws2811_device_t *device = ws2811->device;
+    const rpi_hw_t *rpi_hw = ws2811->rpi_hw;
 
     device->mbox.handle = mbox_open();
     if (device->mbox.handle == -1)
@@ -951,70 +1351,109 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
         return WS2811_ERROR_MMAP;
     }
 
-    // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
-    device->pxl_raw = NULL;
-    device->dma_cb = NULL;
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
-    {
-        ws2811->channel[chan].leds = NULL;
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO, either on the hardware
+ * described by ws2811->rpi_hw or against simulated registers.
+ *
+ * @param    ws2811    ws2811 instance pointer.
+ * @param    simulate  0 for the hardware, SIM_INSTANT or SIM_TIMED for simulated registers and
+ *                     memory.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static ws2811_return_t dma_setup(ws2811_t *ws2811, int simulate)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret;
+    int i;
+
+    // Determine how much physical memory we need for DMA
+    switch (device->driver_mode) {
+    case PWM:
+        device->pxl_size = PWM_BYTE_COUNT(device->max_bytes, ws2811->freq);
+        break;
+
+    case PCM:
+        device->pxl_size = PCM_BYTE_COUNT(device->max_bytes, ws2811->freq);
+        break;
     }
+    device->mbox.size = (device->pxl_size + sizeof(dma_cb_t)) * DMA_BUFFERS;
+    // Round up to page size multiple
+    device->mbox.size = (device->mbox.size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
 
-    // Allocate the LED buffers
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    if (simulate)
     {
-        ws2811_channel_t *channel = &ws2811->channel[chan];
-
-        channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
-        if (!channel->leds)
+        device->sim = sim_create(device->mbox.size);
+        if (!device->sim)
         {
-            ws2811_cleanup(ws2811);
             return WS2811_ERROR_OUT_OF_MEMORY;
         }
 
-        memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
-
-        if (!channel->strip_type)
+        if ((simulate == SIM_TIMED) && sim_start(device->sim))
         {
-          channel->strip_type=WS2811_STRIP_RGB;
+            return WS2811_ERROR_GENERIC;
         }
 
-        // Set default uncorrected gamma table
-        if (!channel->gamma)
-        {
-          channel->gamma = malloc(sizeof(uint8_t) * 256);
-          int x;
-          for(x = 0; x < 256; x++){
-            channel->gamma[x] = x;
-          }
-        }
+        device->mbox.handle = -1;
+        device->mbox.bus_addr = device->sim->mem_bus;
+        device->mbox.virt_addr = device->sim->mem;
+    }
+    else if ((ret = alloc_videocore_mem(ws2811)) != WS2811_SUCCESS)
+    {
+        return ret;
+    }
 
-        channel->wshift = (channel->strip_type >> 24) & 0xff;
-        channel->rshift = (channel->strip_type >> 16) & 0xff;
-        channel->gshift = (channel->strip_type >> 8)  & 0xff;
-        channel->bshift = (channel->strip_type >> 0)  & 0xff;
+    device->pxl_raw = NULL;
+    device->dma_cb = NULL;
 
+    if ((ret = channels_init(ws2811)) != WS2811_SUCCESS)
+    {
+        return ret;
     }
 
-    device->dma_cb = (dma_cb_t *)device->mbox.virt_addr;
-    device->pxl_raw = (uint8_t *)device->mbox.virt_addr + sizeof(dma_cb_t);
+    // Control blocks first to keep them aligned, then the pixel buffers
+    for (i = 0; i < DMA_BUFFERS; i++)
+    {
+        device->dma_cbs[i] = (dma_cb_t *)device->mbox.virt_addr + i;
+        device->pxl_buf[i] = (uint8_t *)device->mbox.virt_addr + DMA_BUFFERS * sizeof(dma_cb_t) +
+                             i * device->pxl_size;
+    }
 
-    switch (device->driver_mode) {
-    case PWM:
-       pwm_raw_init(ws2811);
-       break;
+    for (i = DMA_BUFFERS - 1; i >= 0; i--)
+    {
+        select_buffer(device, i);
 
-    case PCM:
-       pcm_raw_init(ws2811);
-       break;
-    }
+        switch (device->driver_mode) {
+        case PWM:
+           pwm_raw_init(ws2811);
+           break;
 
-    memset((dma_cb_t *)device->dma_cb, 0, sizeof(dma_cb_t));
+        case PCM:
+           pcm_raw_init(ws2811);
+           break;
+        }
+    }
 
-    // Cache the DMA control block bus address
-    device->dma_cb_addr = addr_to_bus(device, device->dma_cb);
+    // Frames are encoded into cached memory, then copied into the DMA buffer
+    if (stage_init(ws2811, device->pxl_size))
+    {
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
 
+    if (device->sim)
+    {
+        device->dma = &device->sim->dma;
+        device->pwm = (device->driver_mode == PWM) ? &device->sim->pwm : NULL;
+        device->pcm = (device->driver_mode == PCM) ? &device->sim->pcm : NULL;
+        device->gpio = &device->sim->gpio;
+        device->cm_clk = &device->sim->cm_clk;
+    }
     // Map the physical registers into userspace
-    if (map_registers(ws2811))
+    else if (map_registers(ws2811))
     {
         ws2811_cleanup(ws2811);
         return WS2811_ERROR_MAP_REGISTERS;
@@ -1028,7 +1467,8 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
         return WS2811_ERROR_GPIO_INIT;
     }
 
-    switch (device->driver_mode) {
+    // The instant simulator's clocks never report busy, leave the peripherals unprogrammed
+    switch ((device->sim && (device->sim->mode == SIM_INSTANT)) ? NONE : device->driver_mode) {
     case PWM:
         // Setup the PWM, clocks, and DMA
         if (setup_pwm(ws2811))
@@ -1049,52 +1489,86 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
         break;
     }
 
+    setup_dma(ws2811);
+
     return WS2811_SUCCESS;
 }
 
-/**
- * Shut down DMA, PWM, and cleanup memory.
- *
- * @param    ws2811  ws2811 instance pointer.
- *
- * @returns  None
- */
-void ws2811_fini(ws2811_t *ws2811)
+static ws2811_return_t dma_init(ws2811_t *ws2811)
 {
-    volatile pcm_t *pcm = ws2811->device->pcm;
+    return dma_setup(ws2811, 0);
+}
 
-    ws2811_wait(ws2811);
-    switch (ws2811->device->driver_mode) {
-    case PWM:
-        stop_pwm(ws2811);
-        break;
-    case PCM:
-        while (!(pcm->cs & RPI_PCM_CS_TXE)) ;    // Wait till TX FIFO is empty
-        stop_pcm(ws2811);
-        break;
+static ws2811_return_t dma_sim_init(ws2811_t *ws2811)
+{
+    // Only the DMA driven outputs can be simulated
+    if (ws2811->device->driver_mode == SPI)
+    {
+        return WS2811_ERROR_SPI_SETUP;
     }
 
-    unmap_registers(ws2811);
+    return dma_setup(ws2811, SIM_INSTANT);
+}
 
-    ws2811_cleanup(ws2811);
+static ws2811_return_t dma_timed_sim_init(ws2811_t *ws2811)
+{
+    if (ws2811->device->driver_mode == SPI)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+
+    return dma_setup(ws2811, SIM_TIMED);
 }
 
 /**
- * Wait for any executing DMA operation to complete before returning.
+ * Start the DMA on the idle buffer.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
- * @returns  0 on success, -1 on DMA competion error
+ * @returns  WS2811_SUCCESS
  */
-ws2811_return_t ws2811_wait(ws2811_t *ws2811)
+static ws2811_return_t dma_submit(ws2811_t *ws2811)
 {
-    volatile dma_t *dma = ws2811->device->dma;
+    ws2811_device_t *device = ws2811->device;
 
-    if (ws2811->device->driver_mode == SPI)  // Nothing to do for SPI
-    {
-        return WS2811_SUCCESS;
+    device->dma_cb->txfr_len = device->tx_size;
+    dma_start(ws2811);
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Check whether the DMA is still running.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  1 while running, 0 when done, WS2811_ERROR_DMA on a DMA error.
+ */
+static int dma_busy(ws2811_t *ws2811)
+{
+    volatile dma_t *dma = ws2811->device->dma;
+
+    if (dma->cs & RPI_DMA_CS_ERROR)
+    {
+        fprintf(stderr, "DMA Error: %08x\n", dma->debug);
+        ws2811->device->dma_ready = 0;
+        return WS2811_ERROR_DMA;
     }
 
+    return (dma->cs & RPI_DMA_CS_ACTIVE) ? 1 : 0;
+}
+
+/**
+ * Poll for the DMA to complete.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 on DMA competion error
+ */
+static ws2811_return_t dma_wait(ws2811_t *ws2811)
+{
+    volatile dma_t *dma = ws2811->device->dma;
+
     while ((dma->cs & RPI_DMA_CS_ACTIVE) &&
            !(dma->cs & RPI_DMA_CS_ERROR))
     {
@@ -1104,6 +1578,7 @@ ws2811_return_t ws2811_wait(ws2811_t *ws2811)
     if (dma->cs & RPI_DMA_CS_ERROR)
     {
         fprintf(stderr, "DMA Error: %08x\n", dma->debug);
+        ws2811->device->dma_ready = 0;
         return WS2811_ERROR_DMA;
     }
 
@@ -1111,148 +1586,1240 @@ ws2811_return_t ws2811_wait(ws2811_t *ws2811)
 }
 
 /**
- * Render the DMA buffer from the user supplied LED arrays and start the DMA
- * controller.  This will update all LEDs on both PWM channels.
+ * Shut down the PWM or PCM and unmap the registers.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
  * @returns  None
  */
-ws2811_return_t  ws2811_render(ws2811_t *ws2811)
+static void dma_fini(ws2811_t *ws2811)
 {
-    volatile uint8_t *pxl_raw = ws2811->device->pxl_raw;
-    int driver_mode = ws2811->device->driver_mode;
-    int bitpos;
-    int i, k, l, chan;
-    unsigned j;
-    ws2811_return_t ret = WS2811_SUCCESS;
-    uint32_t protocol_time = 0;
-    static uint64_t previous_timestamp = 0;
+    volatile pcm_t *pcm = ws2811->device->pcm;
+
+    switch (ws2811->device->driver_mode) {
+    case PWM:
+        stop_pwm(ws2811);
+        break;
+    case PCM:
+        while (!(pcm->cs & RPI_PCM_CS_TXE)) ;    // Wait till TX FIFO is empty
+        stop_pcm(ws2811);
+        break;
+    }
+
+    unmap_registers(ws2811);
+}
 
-    bitpos = (driver_mode == SPI ? 7 : 31);
+// SPI transfers are synchronous, they are over by the time spi_transfer() returns
+static int spi_busy(ws2811_t *ws2811)
+{
+    (void)ws2811;
 
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
+    return 0;
+}
+
+static ws2811_return_t spi_wait(ws2811_t *ws2811)
+{
+    (void)ws2811;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Set up the memory backend.  The encoder output goes into ordinary memory and every frame
+ * sent is captured, see ws2811_get_mem_frame().
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  WS2811_SUCCESS or an error code.
+ */
+static ws2811_return_t mem_init(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret;
+    size_t size;
+
+    device->pxl_raw = NULL;
+    device->dma = NULL;
+    device->pwm = NULL;
+    device->pcm = NULL;
+    device->dma_cb = NULL;
+    device->dma_cb_addr = 0;
+    device->gpio = NULL;
+    device->cm_clk = NULL;
+    device->mbox.handle = -1;
+
+    if ((ret = channels_init(ws2811)) != WS2811_SUCCESS)
     {
-        ws2811_channel_t *channel = &ws2811->channel[chan];
+        return ret;
+    }
 
-        int wordpos = chan; // PWM & PCM
-        int bytepos = 0;    // SPI
-        const int scale = (channel->brightness & 0xff) + 1;
-        uint8_t array_size = 3; // Assume 3 color LEDs, RGB
+    size = (device->driver_mode == PWM) ? PWM_BYTE_COUNT(device->max_bytes, ws2811->freq) :
+                                          PCM_BYTE_COUNT(device->max_bytes, ws2811->freq);
 
-        // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
-        if (channel->strip_type & SK6812_SHIFT_WMASK)
-        {
-            array_size = 4;
-        }
+    if (posix_memalign((void **)&device->pxl_raw, 64, size))
+    {
+        device->pxl_raw = NULL;
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    memset((void *)device->pxl_raw, 0, size);
 
-        // 1.25µs per bit
-        const uint32_t channel_protocol_time = channel->count * array_size * 8 * 1.25;
+    device->mem_frame = malloc(size);
+    if (!device->mem_frame || stage_init(ws2811, size))
+    {
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    device->mem_frame_len = 0;
 
-        // Only using the channel which takes the longest as both run in parallel
-        if (channel_protocol_time > protocol_time)
-        {
-            protocol_time = channel_protocol_time;
-        }
+    return WS2811_SUCCESS;
+}
 
-        for (i = 0; i < channel->count; i++)                // Led
-        {
-            uint8_t color[] =
-            {
-                channel->gamma[(((channel->leds[i] >> channel->rshift) & 0xff) * scale) >> 8], // red
-                channel->gamma[(((channel->leds[i] >> channel->gshift) & 0xff) * scale) >> 8], // green
-                channel->gamma[(((channel->leds[i] >> channel->bshift) & 0xff) * scale) >> 8], // blue
-                channel->gamma[(((channel->leds[i] >> channel->wshift) & 0xff) * scale) >> 8], // white
-            };
+/**
+ * Capture the frame.  The transfer is over when the real one would be, at sent_at.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  WS2811_SUCCESS
+ */
+static ws2811_return_t mem_submit(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
 
-            for (j = 0; j < array_size; j++)               // Color
-            {
-                for (k = 7; k >= 0; k--)                   // Bit
-                {
-                    // Inversion is handled by hardware for PWM, otherwise by software here
-                    uint8_t symbol = SYMBOL_LOW;
-                    if ((driver_mode != PWM) && channel->invert) symbol = SYMBOL_LOW_INV;
-
-                    if (color[j] & (1 << k))
-                    {
-                        symbol = SYMBOL_HIGH;
-                        if ((driver_mode != PWM) && channel->invert) symbol = SYMBOL_HIGH_INV;
-                    }
-
-                    for (l = 2; l >= 0; l--)               // Symbol
-                    {
-                        uint32_t *wordptr = &((uint32_t *)pxl_raw)[wordpos];   // PWM & PCM
-                        volatile uint8_t  *byteptr = &pxl_raw[bytepos];    // SPI
-
-                        if (driver_mode == SPI)
-                        {
-                            *byteptr &= ~(1 << bitpos);
-                            if (symbol & (1 << l))
-                            {
-                                *byteptr |= (1 << bitpos);
-                            }
-                        }
-                        else  // PWM & PCM
-                        {
-                            *wordptr &= ~(1 << bitpos);
-                            if (symbol & (1 << l))
-                            {
-                                *wordptr |= (1 << bitpos);
-                            }
-                        }
-
-                        bitpos--;
-                        if (bitpos < 0)
-                        {
-                            if (driver_mode == SPI)
-                            {
-                                bytepos++;
-                                bitpos = 7;
-                            }
-                            else  // PWM & PCM
-                            {
-                                // Every other word is on the same channel for PWM
-                                wordpos += (driver_mode == PWM ? 2 : 1);
-                                bitpos = 31;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+    memcpy(device->mem_frame, (void *)device->pxl_raw, device->tx_size);
+    if (device->tx_size < device->pxl_size)
+    {
+        tx_trim(device, (uint32_t *)device->mem_frame);
     }
+    device->mem_frame_len = device->tx_size;
 
-    // Wait for any previous DMA operation to complete.
-    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+    return WS2811_SUCCESS;
+}
+
+static int mem_busy(ws2811_t *ws2811)
+{
+    return monotonic_ns() < ws2811->device->sent_at;
+}
+
+static ws2811_return_t mem_wait(ws2811_t *ws2811)
+{
+    (void)ws2811;
+
+    return WS2811_SUCCESS;
+}
+
+static void mem_fini(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    // SPI encodes straight into pxl_raw
+    if (device->pxl_stage == (uint32_t *)device->pxl_raw)
     {
-        return ret;
+        device->pxl_stage = NULL;
     }
+    free((void *)device->pxl_raw);
+    device->pxl_raw = NULL;
+}
 
-    if (ws2811->render_wait_time != 0) {
-        const uint64_t current_timestamp = get_microsecond_timestamp();
-        uint64_t time_diff = current_timestamp - previous_timestamp;
+static const ws2811_backend_t dma_backend =
+{
+    .init = dma_init,
+    .submit = dma_submit,
+    .busy = dma_busy,
+    .wait = dma_wait,
+    .fini = dma_fini,
+};
+
+static const ws2811_backend_t sim_backend =
+{
+    .init = dma_sim_init,
+    .submit = dma_submit,
+    .busy = dma_busy,
+    .wait = dma_wait,
+    .fini = dma_fini,
+};
+
+static const ws2811_backend_t timed_sim_backend =
+{
+    .init = dma_timed_sim_init,
+    .submit = dma_submit,
+    .busy = dma_busy,
+    .wait = dma_wait,
+    .fini = dma_fini,
+};
+
+static const ws2811_backend_t spi_backend =
+{
+    .init = spi_init,
+    .submit = spi_transfer,
+    .busy = spi_busy,
+    .wait = spi_wait,
+    .fini = unmap_registers,
+};
+
+static const ws2811_backend_t mem_backend =
+{
+    .init = mem_init,
+    .submit = mem_submit,
+    .busy = mem_busy,
+    .wait = mem_wait,
+    .fini = mem_fini,
+};
+
+// Stands in for the Pi when running against the simulator or the memory backend
+static const rpi_hw_t virtual_hw =
+{
+    .type = RPI_HWVER_TYPE_PI2,
+    .hwver = 0xa01041,
+    .periph_base = 0x3f000000,
+    .videocore_base = 0xc0000000,
+    .desc = "Simulated",
+};
 
-        if (ws2811->render_wait_time > time_diff) {
-            usleep(ws2811->render_wait_time - time_diff);
-        }
+/**
+ * Set up the parts common to every backend, then the backend.
+ *
+ * @param    ws2811   ws2811 instance pointer.
+ * @param    backend  Output to use, NULL for the hardware the GPIO of channel 0 belongs to.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static ws2811_return_t init_device(ws2811_t *ws2811, const ws2811_backend_t *backend)
+{
+    ws2811_device_t *device;
+    int chan;
+
+    ws2811->device = malloc(sizeof(*ws2811->device));
+    if (!ws2811->device)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+    device = ws2811->device;
+    device->spi_fd = 0; // XXX - Cleaning up valgrind
+    device->pcm = NULL; // XXX - Cleaning up valgrind
+    device->pxl_stage = NULL;
+    memset(device->shadow, 0, sizeof(device->shadow));
+    device->sim = NULL;
+    device->sent_at = 0;
+    device->done_at = 0;
+    device->render_at = 0;
+    device->dma_ready = 0;
+    device->async_fd = -1;
+    device->async_queued = 0;
+    device->pool = NULL;
+    device->workers = 0;
+    device->spi_reset = NULL;
+    device->mem_frame = NULL;
+    device->mem_frame_len = 0;
+    device->mem_instant = 0;
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        device->lut_brightness[chan] = -1;
+    }
+    memset(&device->stats, 0, sizeof(device->stats));
+    if (check_hwver_and_gpionum(ws2811) < 0)
+    {
+        return WS2811_ERROR_ILLEGAL_GPIO;
     }
 
-    if (driver_mode != SPI)
+    device->max_bytes = max_channel_byte_count(ws2811);
+
+    // Pick the pixel encoder for this CPU
+    encode_init();
+
+    // Without a backend of its own the instance drives the hardware its GPIO belongs to
+    if (!backend)
     {
-        dma_start(ws2811);
+        backend = (device->driver_mode == SPI) ? &spi_backend : &dma_backend;
     }
-    else
+    device->backend = backend;
+
+    return backend->init(ws2811);
+}
+
+/**
+ * Allocate and initialize memory, buffers, pages, PWM, DMA, and GPIO.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_init(ws2811_t *ws2811)
+{
+    ws2811->rpi_hw = rpi_hw_detect();
+    if (!ws2811->rpi_hw)
     {
-        ret = spi_transfer(ws2811);
+        return WS2811_ERROR_HW_NOT_SUPPORTED;
     }
 
-    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
-    previous_timestamp = get_microsecond_timestamp();
-    ws2811->render_wait_time = protocol_time + LED_RESET_WAIT_TIME;
+    return init_device(ws2811, NULL);
+}
+
+/**
+ * Initialize against simulated peripheral registers and memory instead of the hardware,
+ * which makes the whole render path runnable on any machine.  DMA transfers complete as
+ * soon as they are started, see sim.h.  Only PWM and PCM can be simulated.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_sim_init(ws2811_t *ws2811)
+{
+    ws2811->rpi_hw = &virtual_hw;
+
+    return init_device(ws2811, &sim_backend);
+}
+
+/**
+ * Like ws2811_sim_init(), but the simulated peripherals run in real time: the PWM or PCM
+ * setup and the DMA go through the same register sequence as on the hardware, and frames
+ * take as long as on the wire.  sim.h lists the timings the model records.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_timed_sim_init(ws2811_t *ws2811)
+{
+    ws2811->rpi_hw = &virtual_hw;
+
+    return init_device(ws2811, &timed_sim_backend);
+}
+
+/**
+ * Initialize against an output that captures every frame in memory.  Frames are encoded in
+ * the layout the GPIO of channel 0 selects, PWM, PCM or SPI, and take as long to send as on
+ * the wire, so the encoder and the frame pacing behave as on the hardware.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_mem_init(ws2811_t *ws2811)
+{
+    ws2811->rpi_hw = &virtual_hw;
+
+    return init_device(ws2811, &mem_backend);
+}
+
+/**
+ * Like ws2811_mem_init(), but frames are sent as soon as they are captured, without the wire
+ * or reset time.  Nothing waits, so only the cost of rendering is left, see bench.c.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_mem_instant_init(ws2811_t *ws2811)
+{
+    ws2811_return_t ret;
+
+    ws2811->rpi_hw = &virtual_hw;
+
+    if ((ret = init_device(ws2811, &mem_backend)) == WS2811_SUCCESS)
+    {
+        ws2811->device->mem_instant = 1;
+    }
 
     return ret;
 }
 
+/**
+ * Simulator behind an instance set up by ws2811_sim_init().
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Simulator, or NULL when running on hardware.
+ */
+struct sim *ws2811_get_sim(ws2811_t *ws2811)
+{
+    return ws2811->device->sim;
+}
+
+/**
+ * Last frame sent by an instance set up by ws2811_mem_init() or ws2811_mem_instant_init(), as
+ * it would go out on the wire including the reset.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    len     Filled with the length of the frame in bytes, 0 before the first frame.
+ *
+ * @returns  Frame, or NULL for any other backend.
+ */
+const uint8_t *ws2811_get_mem_frame(ws2811_t *ws2811, size_t *len)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (device->backend != &mem_backend)
+    {
+        *len = 0;
+        return NULL;
+    }
+
+    *len = device->mem_frame_len;
+    return device->mem_frame;
+}
+
+/**
+ * Decode the LEDs of one channel from a frame in the layout of pxl_raw, as captured by the
+ * memory backend or the simulator.  A shortened frame decodes to the LEDs it updates.
+ *
+ * @param    ws2811   ws2811 instance pointer.
+ * @param    frame    Frame, word aligned.
+ * @param    len      Length of the frame in bytes.
+ * @param    channel  Channel to decode.
+ * @param    leds     Filled with the colours after brightness and gamma, one per LED sent.
+ * @param    error    Filled in on a malformed symbol, may be NULL.
+ *
+ * @returns  Number of LEDs decoded, -1 on a malformed symbol.
+ */
+int ws2811_decode_frame(ws2811_t *ws2811, const uint8_t *frame, size_t len, int channel,
+                        ws2811_led_t *leds, struct decode_error *error)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_channel_t *ch = &ws2811->channel[channel];
+    const size_t stride = (device->driver_mode == PWM) ? 2 : 1;
+    const size_t words = len / sizeof(uint32_t);
+    decode_format_t format =
+    {
+        .layout = driver_layout(device),
+        .invert = (device->driver_mode != PWM) && ch->invert,
+        .colours = channel_colours(ch),
+        .shift = { ch->rshift, ch->gshift, ch->bshift, ch->wshift },
+    };
+    int chan, bitpos = 31;
+
+    if (words <= (size_t)channel)
+    {
+        return 0;
+    }
+
+    // The bit position carries over from the channels before, as in render_encode()
+    for (chan = 0; chan < channel; chan++)
+    {
+        bitpos = (bitpos - ws2811->channel[chan].count * channel_colours(&ws2811->channel[chan]) *
+                  ENCODE_SYMBOL_BITS) & 31;
+    }
+
+    return decode_channel((const uint32_t *)frame + channel, (words - channel + stride - 1) / stride,
+                          bitpos, &format, leds, ch->count, error);
+}
+
+/**
+ * Shut down DMA, PWM, and cleanup memory.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+void ws2811_fini(ws2811_t *ws2811)
+{
+    ws2811_wait(ws2811);
+    ws2811->device->backend->fini(ws2811);
+
+    ws2811_cleanup(ws2811);
+}
+
+/**
+ * Wait for any executing DMA operation to complete before returning.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 on DMA competion error
+ */
+ws2811_return_t ws2811_wait(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int busy = device->backend->busy(ws2811);
+
+    if (busy < 0)
+    {
+        return busy;
+    }
+
+    // The transfer finishes no later than the last bit going out, so sleep until then in one
+    // go and only poll if it is running late.
+    if (busy)
+    {
+        monotonic_sleep_until(device->sent_at);
+    }
+
+    return device->backend->wait(ws2811);
+}
+
+/**
+ * Rebuild the brightness/gamma table of a channel if its brightness or gamma table changed.
+ * Both are plain fields callers may write at any time, so they are compared on every frame,
+ * which costs far less than the multiply and dependent load per colour byte it saves.
+ *
+ * @param    device   Device.
+ * @param    chan     Channel index.
+ * @param    channel  Channel.
+ *
+ * @returns  1 if the table was rebuilt, 0 otherwise.
+ */
+static int update_lut(ws2811_device_t *device, int chan, const ws2811_channel_t *channel)
+{
+    const int scale = (channel->brightness & 0xff) + 1;
+    int i;
+
+    if ((device->lut_brightness[chan] == channel->brightness) &&
+        !memcmp(device->lut_gamma[chan], channel->gamma, sizeof(device->lut_gamma[chan])))
+    {
+        return 0;
+    }
+
+    memcpy(device->lut_gamma[chan], channel->gamma, sizeof(device->lut_gamma[chan]));
+    device->lut_brightness[chan] = channel->brightness;
+
+    for (i = 0; i < 256; i++)
+    {
+        device->lut[chan][i] = channel->gamma[(i * scale) >> 8];
+    }
+
+    return 1;
+}
+
+/**
+ * Compare strip LEDs [start, start + len) of a channel read through its map with the shadow
+ * copy, and optionally update the shadow.
+ *
+ * @param    shadow   Shadow copy of the range.
+ * @param    leds     LED array of the channel.
+ * @param    count    Number of LEDs of the channel.
+ * @param    offset   Ring offset, 0 <= offset < count.
+ * @param    map      Ring LED shown by each strip LED.
+ * @param    start    First strip LED of the range.
+ * @param    len      Number of LEDs.
+ * @param    copy     Copy the LEDs to the shadow if they differ.
+ *
+ * @returns  Non-zero if the range differs from the shadow.
+ */
+static int map_update(ws2811_led_t *shadow, const ws2811_led_t *leds, int count, int offset,
+                      const uint32_t *map, int start, int len, int copy)
+{
+    int differs = 0;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        uint32_t index = map[start + i];
+        ws2811_led_t led = 0;
+
+        if (index != WS2811_MAP_NONE)
+        {
+            index += offset;
+            led = leds[(index >= (uint32_t)count) ? (index - count) : index];
+        }
+
+        if (shadow[i] != led)
+        {
+            differs = 1;
+            if (!copy)
+            {
+                break;
+            }
+            shadow[i] = led;
+        }
+    }
+
+    return differs;
+}
+
+/**
+ * Compare strip LEDs [start, start + len) of a channel with the shadow copy, and optionally
+ * update the shadow.  The LED array is a ring, strip LED i is leds[(i + offset) % count], so
+ * a range is at most two contiguous pieces of it.
+ *
+ * @param    shadow   Shadow copy of the range.
+ * @param    leds     LED array of the channel.
+ * @param    count    Number of LEDs of the channel.
+ * @param    offset   Ring offset, 0 <= offset < count.
+ * @param    map      Ring LED shown by each strip LED, NULL to show them in order.
+ * @param    start    First strip LED of the range.
+ * @param    len      Number of LEDs.
+ * @param    copy     Copy the LEDs to the shadow if they differ.
+ *
+ * @returns  Non-zero if the range differs from the shadow.
+ */
+static int ring_update(ws2811_led_t *shadow, const ws2811_led_t *leds, int count, int offset,
+                       const uint32_t *map, int start, int len, int copy)
+{
+    int first = start + offset;
+    int head, differs;
+
+    if (map)
+    {
+        return map_update(shadow, leds, count, offset, map, start, len, copy);
+    }
+
+    if (first >= count)
+    {
+        first -= count;
+    }
+    head = count - first;
+
+    if (len <= head)
+    {
+        differs = memcmp(shadow, &leds[first], sizeof(ws2811_led_t) * len);
+        if (differs && copy)
+        {
+            memcpy(shadow, &leds[first], sizeof(ws2811_led_t) * len);
+        }
+        return differs;
+    }
+
+    differs = memcmp(shadow, &leds[first], sizeof(ws2811_led_t) * head) ||
+              memcmp(&shadow[head], leds, sizeof(ws2811_led_t) * (len - head));
+    if (differs && copy)
+    {
+        memcpy(shadow, &leds[first], sizeof(ws2811_led_t) * head);
+        memcpy(&shadow[head], leds, sizeof(ws2811_led_t) * (len - head));
+    }
+
+    return differs;
+}
+
+/**
+ * Find the LEDs of a channel that changed since they were last encoded and update the shadow
+ * copy.  Ranges are in groups of 4 LEDs, the group an LED is in always starts at the same bit
+ * offset of the channel.  The shadow is kept in strip order, which is where the ring offset
+ * and the map of the channel get applied.
+ *
+ * @param    device   Device.
+ * @param    chan     Channel index.
+ * @param    channel  Channel.
+ * @param    ranges   Filled with start and end LED of each range.
+ *
+ * @returns  Number of ranges.
+ */
+static int find_dirty(ws2811_device_t *device, int chan, const ws2811_channel_t *channel,
+                      int ranges[ENCODE_RANGES_MAX][2])
+{
+    ws2811_led_t *shadow = device->shadow[chan];
+    const ws2811_led_t *leds = channel->leds;
+    int count = channel->count;
+    int offset = channel->offset % count;
+    int i, n = 0;
+
+    if (offset < 0)
+    {
+        offset += count;
+    }
+
+    if (!device->shadow_valid[chan])
+    {
+        ring_update(shadow, leds, count, offset, channel->map, 0, count, 1);
+        device->shadow_valid[chan] = 1;
+
+        ranges[0][0] = 0;
+        ranges[0][1] = count;
+        return 1;
+    }
+
+    // Mostly nothing changed, one vectorised compare settles that
+    if (!ring_update(shadow, leds, count, offset, channel->map, 0, count, 0))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < count; i += 4)
+    {
+        int len = (count - i < 4) ? (count - i) : 4;
+
+        if (!ring_update(&shadow[i], leds, count, offset, channel->map, i, len, 1))
+        {
+            continue;
+        }
+
+        // Join the previous range if close enough, or if there is no room for another one
+        if (n && ((i - ranges[n - 1][1] < ENCODE_RANGE_GAP) || (n == ENCODE_RANGES_MAX)))
+        {
+            ranges[n - 1][1] = i + len;
+        }
+        else
+        {
+            ranges[n][0] = i;
+            ranges[n][1] = i + len;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Queue the encoding of a range of LEDs of a channel.  With worker threads a range starting
+ * on a word boundary is split further into word aligned pieces, one per thread.
+ *
+ * @param    device   Device.
+ * @param    chan     Channel index.
+ * @param    encode   Channel to encode.
+ * @param    bitpos   Bit position the channel starts at in its first word.
+ * @param    start    First LED of the range, a multiple of 4.
+ * @param    end      LED after the range.
+ * @param    split    Allow splitting the range between threads.
+ * @param    jobs     Number of jobs queued so far.
+ *
+ * @returns  Number of jobs queued including this range.
+ */
+static int queue_jobs(ws2811_device_t *device, int chan, const encode_channel_t *encode,
+                      int bitpos, int start, int end, int split, int jobs)
+{
+    const int stride = (device->driver_mode == PWM) ? 2 : 1;
+    const int bits = encode->colours * ENCODE_SYMBOL_BITS;
+    const int offset = (31 - bitpos) + start * bits;
+    int count = end - start;
+    int chunks = 1, chunk, i;
+    encode_stream_t stream =
+    {
+        .words = device->pxl_stage + chan + (offset / 32) * stride,
+        .bitpos = 31 - (offset % 32),
+    };
+
+    if (device->pool && split && (stream.bitpos == 31))
+    {
+        chunks = count / ENCODE_CHUNK_LEDS;
+        if (chunks > device->workers + 1)
+        {
+            chunks = device->workers + 1;
+        }
+        if (chunks < 1)
+        {
+            chunks = 1;
+        }
+    }
+
+    // Multiple of 4 LEDs so every chunk starts on a word boundary
+    chunk = (count / chunks) & ~3;
+
+    for (i = 0; i < chunks; i++)
+    {
+        encode_job_t *job = &device->jobs[jobs++];
+        int first = i * chunk;
+
+        job->render = device->encode[chan];
+        job->channel = *encode;
+        job->channel.leds += start + first;
+        job->channel.count = (i == chunks - 1) ? (count - first) : chunk;
+        job->stream.words = stream.words + ENCODE_WORDS(first, encode->colours) * stride;
+        job->stream.bitpos = stream.bitpos;
+    }
+
+    device->stats.leds_encoded += count;
+
+    return jobs;
+}
+
+/**
+ * Encode the user supplied LED arrays into the staging buffer and copy it into the idle DMA
+ * buffer.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Time in µs it takes to send the frame, 0 if it is identical to the frames already
+ *           sent or queued and there is nothing to send.
+ */
+static uint32_t render_encode(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    uint32_t *pxl_stage = device->pxl_stage;
+    int driver_mode = device->driver_mode;
+    int chan, i, jobs = 0, bitpos = 31;
+    int ranges[ENCODE_RANGES_MAX][2];
+    int start_bitpos[RPI_PWM_CHANNELS];
+    uint32_t protocol_time = 0;
+    uint64_t encode_start, encode_ns, copy_start;
+
+    encode_start = monotonic_ns();
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        uint8_t array_size = 3; // Assume 3 color LEDs, RGB
+
+        // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
+        if (channel->strip_type & SK6812_SHIFT_WMASK)
+        {
+            array_size = 4;
+        }
+
+        start_bitpos[chan] = bitpos;
+
+        if (!channel->count)
+        {
+            continue;
+        }
+
+        // A new brightness or gamma table changes every LED
+        if (update_lut(device, chan, channel))
+        {
+            device->shadow_valid[chan] = 0;
+        }
+
+        // Encode from the shadow copy so it always matches what is in pxl_stage
+        int dirty = find_dirty(device, chan, channel, ranges);
+
+        // The LEDs after the last change still show what was sent before, unless a frame
+        // encoded since the last transfer changed them and is still waiting
+        if (dirty && (ranges[dirty - 1][1] > device->tx_end[chan]))
+        {
+            device->tx_end[chan] = ranges[dirty - 1][1];
+        }
+
+        // 1.25µs per bit
+        const uint32_t channel_protocol_time = device->tx_end[chan] * array_size * 8 * 1.25;
+
+        // Only using the channel which takes the longest as both run in parallel
+        if (channel_protocol_time > protocol_time)
+        {
+            protocol_time = channel_protocol_time;
+        }
+
+        encode_channel_t encode =
+        {
+            .leds = device->shadow[chan],
+            .count = channel->count,
+            .colours = array_size,
+            .shift = { channel->rshift, channel->gshift, channel->bshift, channel->wshift },
+            .lut = device->lut[chan],
+            // Inversion is handled by hardware for PWM, otherwise by software here
+            .invert = (driver_mode != PWM) && channel->invert,
+        };
+
+        // Each channel starts at its own word, the bit position carries over as before
+        for (i = 0; i < dirty; i++)
+        {
+            jobs = queue_jobs(device, chan, &encode, bitpos, ranges[i][0], ranges[i][1],
+                              dirty == 1, jobs);
+        }
+        bitpos = (bitpos - encode.count * array_size * ENCODE_SYMBOL_BITS) & 31;
+    }
+
+    // Channels and chunks write disjoint words, so they can be encoded in any order
+    if (device->pool && (jobs > 1))
+    {
+        encode_pool_run(device->pool, device->jobs, jobs);
+    }
+    else
+    {
+        for (i = 0; i < jobs; i++)
+        {
+            device->jobs[i].render(&device->jobs[i].channel, &device->jobs[i].stream);
+        }
+    }
+
+    encode_ns = monotonic_ns() - encode_start;
+    device->stats.encode_ns += encode_ns;
+    device->stats.last_encode_ns = encode_ns;
+
+    if (!protocol_time)
+    {
+        device->stats.frames_skipped++;
+        return 0;
+    }
+
+    tx_measure(ws2811, start_bitpos);
+
+    // pxl_raw is the idle DMA buffer, so this overlaps with any transfer still running
+    if (pxl_stage != (uint32_t *)device->pxl_raw)
+    {
+        copy_start = monotonic_ns();
+        stage_copy(device);
+        device->stats.copy_ns += monotonic_ns() - copy_start;
+    }
+    device->stats.frames++;
+
+    return protocol_time;
+}
+
+/**
+ * Send the frame in the idle buffer.  The previous transfer must have finished.
+ *
+ * @param    ws2811         ws2811 instance pointer.
+ * @param    protocol_time  Time in µs it takes to send the frame.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static ws2811_return_t render_start(ws2811_t *ws2811, uint32_t protocol_time)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret = WS2811_SUCCESS;
+    uint64_t start, started;
+
+    int chan;
+
+    start = monotonic_ns();
+    ret = device->backend->submit(ws2811);
+    started = monotonic_ns();
+
+    device->stats.starts++;
+    device->stats.start_ns += started - start;
+    device->stats.last_start_ns = started - start;
+    device->stats.last_latency_ns = started - device->render_at;
+
+    // Everything changed so far is on its way to the LEDs
+    if (ret == WS2811_SUCCESS)
+    {
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            device->tx_end[chan] = 0;
+        }
+    }
+
+    if (device->mem_instant)
+    {
+        device->sent_at = monotonic_ns();
+        device->done_at = device->sent_at;
+    }
+    else
+    {
+        device->sent_at = monotonic_ns() + (uint64_t)protocol_time * 1000;
+        device->done_at = device->sent_at + (uint64_t)LED_RESET_WAIT_TIME * 1000;
+    }
+
+    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
+    ws2811->render_wait_time = protocol_time + LED_RESET_WAIT_TIME;
+
+    return ret;
+}
+
+/**
+ * Render the DMA buffer from the user supplied LED arrays and start the DMA
+ * controller.  This will update all LEDs on both PWM channels.  Nothing is sent if the
+ * LEDs already show this frame, see ws2811_stats_t.frames_skipped.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+ws2811_return_t  ws2811_render(ws2811_t *ws2811)
+{
+    ws2811_return_t ret = WS2811_SUCCESS;
+    uint32_t protocol_time;
+
+    ws2811->device->render_at = monotonic_ns();
+
+    // Anything queued by ws2811_render_async() is replaced by this frame
+    ws2811->device->async_queued = 0;
+
+    // The LEDs already show this frame
+    if (!(protocol_time = render_encode(ws2811)))
+    {
+        return WS2811_SUCCESS;
+    }
+
+    // Wait for any previous DMA operation to complete.
+    if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    // Sleep out the rest of the reset time in one go
+    if (ws2811->render_wait_time != 0) {
+        monotonic_sleep_until(ws2811->device->done_at);
+    }
+
+    return render_start(ws2811, protocol_time);
+}
+
+/**
+ * Arm the completion timer.
+ *
+ * @param    device  Device.
+ * @param    when    Absolute CLOCK_MONOTONIC time in ns.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static int async_arm(ws2811_device_t *device, uint64_t when)
+{
+    struct itimerspec its =
+    {
+        .it_value =
+        {
+            .tv_sec = when / 1000000000,
+            .tv_nsec = when % 1000000000,
+        },
+    };
+
+    // A zero it_value would disarm the timer
+    if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+    {
+        its.it_value.tv_nsec = 1;
+    }
+
+    return timerfd_settime(device->async_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * Start the queued frame if the previous one is over, otherwise make sure the timer fires
+ * once it is.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static ws2811_return_t async_kick(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    uint64_t now = monotonic_ns();
+    int busy = device->backend->busy(ws2811);
+    ws2811_return_t ret;
+
+    if (busy < 0)
+    {
+        return busy;
+    }
+
+    if (!device->async_queued)
+    {
+        return WS2811_SUCCESS;
+    }
+
+    if (now < device->done_at)
+    {
+        return async_arm(device, device->done_at) ? WS2811_ERROR_GENERIC : WS2811_SUCCESS;
+    }
+
+    if (busy)
+    {
+        // Running late, look again shortly
+        return async_arm(device, now + 10000) ? WS2811_ERROR_GENERIC : WS2811_SUCCESS;
+    }
+
+    device->async_queued = 0;
+    if ((ret = render_start(ws2811, device->async_protocol_time)) != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    return async_arm(device, device->done_at) ? WS2811_ERROR_GENERIC : WS2811_SUCCESS;
+}
+
+/**
+ * Get the completion handle for ws2811_render_async().  The descriptor becomes readable once
+ * a frame has been sent and the reset time has passed; call ws2811_async_complete() then.
+ * It is suitable for poll(), select() and epoll.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  File descriptor owned by the driver, or -1 on error.
+ */
+int ws2811_get_async_fd(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (device->async_fd < 0)
+    {
+        device->async_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (device->async_fd < 0)
+        {
+            fprintf(stderr, "Can't create completion timer\n");
+        }
+    }
+
+    return device->async_fd;
+}
+
+/**
+ * Encode the LED arrays and queue the frame without blocking.  It is sent as soon as the
+ * previous frame is over, a frame still waiting from an earlier call is replaced.  The DMA
+ * raises no interrupt that userspace can see, so completion is signalled by a timer armed for
+ * the end of the transmission plus LED_RESET_WAIT_TIME.  SPI transfers are synchronous in the
+ * kernel and are started right away when possible.  A frame the LEDs already show is not
+ * queued, the descriptor still becomes readable.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_render_async(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (ws2811_get_async_fd(ws2811) < 0)
+    {
+        return WS2811_ERROR_GENERIC;
+    }
+
+    device->render_at = monotonic_ns();
+    device->async_protocol_time = render_encode(ws2811);
+
+    // Nothing to send, signal completion once the frame on the wire is over
+    if (!device->async_protocol_time)
+    {
+        return async_arm(device, device->done_at) ? WS2811_ERROR_GENERIC : WS2811_SUCCESS;
+    }
+
+    device->async_queued = 1;
+
+    return async_kick(ws2811);
+}
+
+/**
+ * Handle a readable completion descriptor.  Starts the queued frame, if any, and re-arms the
+ * descriptor for it.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_async_complete(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    uint64_t expirations;
+
+    if (device->async_fd < 0)
+    {
+        return WS2811_ERROR_GENERIC;
+    }
+
+    // Nothing to read just means the call was early, async_kick() copes with that
+    if ((read(device->async_fd, &expirations, sizeof(expirations)) < 0) && (errno != EAGAIN))
+    {
+        return WS2811_ERROR_GENERIC;
+    }
+
+    return async_kick(ws2811);
+}
+
+/**
+ * Check whether a frame is still queued or being sent.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  1 if busy, 0 if idle.
+ */
+int ws2811_async_busy(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    return device->async_queued || (monotonic_ns() < device->done_at);
+}
+
+/**
+ * Set the number of encoder threads.  Both PWM channels are then encoded concurrently, and
+ * long channels are split into ranges of LEDs encoded in parallel.  The calling thread always
+ * takes part, so 0 (the default) encodes inline and n uses n + 1 cores.
+ *
+ * @param    ws2811   ws2811 instance pointer.
+ * @param    workers  Number of threads, at most 16.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+ws2811_return_t ws2811_set_encode_workers(ws2811_t *ws2811, int workers)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if ((workers < 0) || (workers > ENCODE_WORKERS_MAX))
+    {
+        return WS2811_ERROR_GENERIC;
+    }
+
+    encode_pool_destroy(device->pool);
+    device->pool = NULL;
+    device->workers = 0;
+
+    if (workers)
+    {
+        device->pool = encode_pool_create(workers);
+        if (!device->pool)
+        {
+            fprintf(stderr, "Can't start %d encoder threads\n", workers);
+            return WS2811_ERROR_GENERIC;
+        }
+        device->workers = workers;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Set the brightness of a channel.  Equivalent to writing channel->brightness, which keeps
+ * working; either way the brightness/gamma table is rebuilt on the next render.
+ *
+ * @param    ws2811      ws2811 instance pointer.
+ * @param    channel     Channel index.
+ * @param    brightness  Brightness value between 0 and 255.
+ *
+ * @returns  None
+ */
+void ws2811_set_brightness(ws2811_t *ws2811, int channel, uint8_t brightness)
+{
+    if ((channel >= 0) && (channel < RPI_PWM_CHANNELS))
+    {
+        ws2811->channel[channel].brightness = brightness;
+    }
+}
+
+/**
+ * Get the time the hardware is ready for the next frame, i.e. when the last frame has been
+ * sent and the LEDs have latched it.  Callers can do other work until then instead of
+ * blocking in ws2811_render() or ws2811_wait().
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  CLOCK_MONOTONIC time in nanoseconds, in the past if the hardware is idle.
+ */
+uint64_t ws2811_get_ready_time(ws2811_t *ws2811)
+{
+    return ws2811->device->done_at;
+}
+
+/**
+ * Get the time one frame occupies the wire, sized from the colour count and length of the
+ * longest channel plus the reset time.  No frame can be shown faster than this.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Frame time in microseconds.
+ */
+uint32_t ws2811_get_frame_time(ws2811_t *ws2811)
+{
+    uint64_t bytes = PCM_BYTE_COUNT(ws2811->device->max_bytes, ws2811->freq);
+
+    // Every symbol is a third of a bit period
+    return (bytes * 8 * 1000000) / (ws2811->freq * 3);
+}
+
+/**
+ * Get the peripheral an instance drives.  The memory backend and the simulator report the one
+ * they stand in for.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  WS2811_DRIVER_PWM, WS2811_DRIVER_PCM or WS2811_DRIVER_SPI.
+ */
+int ws2811_get_driver(ws2811_t *ws2811)
+{
+    return ws2811->device->driver_mode;
+}
+
+/**
+ * Read the render statistics.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    stats   Filled in with the counters since init or the last reset.
+ *
+ * @returns  None
+ */
+void ws2811_get_stats(ws2811_t *ws2811, ws2811_stats_t *stats)
+{
+    *stats = ws2811->device->stats;
+}
+
+/**
+ * Clear the render statistics.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+void ws2811_reset_stats(ws2811_t *ws2811)
+{
+    memset(&ws2811->device->stats, 0, sizeof(ws2811->device->stats));
+}
+
 const char * ws2811_get_return_t_str(const ws2811_return_t state)
 {
     const int index = -state;
@@ -35,6 +35,8 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 #include "rpihw.h"
 #include "pwm.h"
 
@@ -63,7 +65,17 @@ extern "C" {
 #define SK6812_STRIP                             WS2811_STRIP_GRB
 #define SK6812W_STRIP                            SK6812_STRIP_GRBW
 
+// Strip LED of a channel map without a source LED, it stays dark
+#define WS2811_MAP_NONE                          0xffffffff
+
+// Peripheral an instance drives, picked from channel 0's GPIO, see ws2811_get_driver()
+#define WS2811_DRIVER_PWM                        1
+#define WS2811_DRIVER_PCM                        2
+#define WS2811_DRIVER_SPI                        3
+
 struct ws2811_device;
+struct sim;
+struct decode_error;
 
 typedef uint32_t ws2811_led_t;                   //< 0xWWRRGGBB
 typedef struct
@@ -79,6 +91,8 @@ typedef struct
     uint8_t gshift;                              //< Green shift value
     uint8_t bshift;                              //< Blue shift value
     uint8_t *gamma;                              //< Gamma correction table
+    int offset;                                  //< LEDs are a ring, strip LED 0 is leds[offset]
+    const uint32_t *map;                         //< If set strip LED i shows ring LED map[i], see layout.h
 } ws2811_channel_t;
 
 typedef struct
@@ -91,6 +105,21 @@ typedef struct
     ws2811_channel_t channel[RPI_PWM_CHANNELS];
 } ws2811_t;
 
+typedef struct
+{
+    uint64_t frames;                             //< Frames rendered
+    uint64_t frames_skipped;                     //< Frames not sent, identical to the LEDs' state
+    uint64_t encode_ns;                          //< Time spent encoding LEDs into the staging buffer
+    uint64_t last_encode_ns;                     //< Encode time of the last frame
+    uint64_t leds_encoded;                       //< LEDs encoded, unchanged LEDs are skipped
+    uint64_t copy_ns;                            //< Time spent copying the staging buffer to DMA memory
+    uint64_t starts;                             //< Transfers started
+    uint64_t fast_starts;                        //< Transfers started without resetting the DMA channel
+    uint64_t start_ns;                           //< Time spent starting transfers
+    uint64_t last_start_ns;                      //< Time starting the last transfer took
+    uint64_t last_latency_ns;                    //< Render call to the last transfer running, incl. any wait
+} ws2811_stats_t;
+
 #define WS2811_RETURN_STATES(X)                                                             \
             X(0, WS2811_SUCCESS, "Success"),                                                \
             X(-1, WS2811_ERROR_GENERIC, "Generic failure"),                                 \
@@ -118,9 +147,28 @@ typedef enum {
 } ws2811_return_t;
 
 ws2811_return_t ws2811_init(ws2811_t *ws2811);                         //< Initialize buffers/hardware
+ws2811_return_t ws2811_sim_init(ws2811_t *ws2811);                     //< Initialize against simulated hardware
+ws2811_return_t ws2811_timed_sim_init(ws2811_t *ws2811);               //< Same, peripherals running in real time
+struct sim *ws2811_get_sim(ws2811_t *ws2811);                          //< Simulator of an instance, NULL on hardware
+ws2811_return_t ws2811_mem_init(ws2811_t *ws2811);                     //< Initialize against an output capturing frames in memory
+ws2811_return_t ws2811_mem_instant_init(ws2811_t *ws2811);             //< Same, frames take no time to send
+const uint8_t *ws2811_get_mem_frame(ws2811_t *ws2811, size_t *len);    //< Last frame captured by the memory output
+int ws2811_decode_frame(ws2811_t *ws2811, const uint8_t *frame, size_t len, int channel,
+                        ws2811_led_t *leds, struct decode_error *error);  //< Decode a channel from a captured frame
 void ws2811_fini(ws2811_t *ws2811);                                    //< Tear it all down
 ws2811_return_t ws2811_render(ws2811_t *ws2811);                       //< Send LEDs off to hardware
 ws2811_return_t ws2811_wait(ws2811_t *ws2811);                         //< Wait for DMA completion
+ws2811_return_t ws2811_render_async(ws2811_t *ws2811);                 //< Queue LEDs for the hardware, never blocks
+int ws2811_get_async_fd(ws2811_t *ws2811);                             //< Pollable handle, readable when a frame is done
+ws2811_return_t ws2811_async_complete(ws2811_t *ws2811);               //< Handle a readable async fd
+int ws2811_async_busy(ws2811_t *ws2811);                               //< Frame queued or still being sent
+ws2811_return_t ws2811_set_encode_workers(ws2811_t *ws2811, int workers);  //< Encoder threads, 0 to encode inline
+void ws2811_set_brightness(ws2811_t *ws2811, int channel, uint8_t brightness);  //< Set channel brightness
+uint64_t ws2811_get_ready_time(ws2811_t *ws2811);                      //< CLOCK_MONOTONIC ns when the next frame can go out
+uint32_t ws2811_get_frame_time(ws2811_t *ws2811);                      //< Wire time of one frame in µs
+int ws2811_get_driver(ws2811_t *ws2811);                               //< WS2811_DRIVER_xxx of an initialized instance
+void ws2811_get_stats(ws2811_t *ws2811, ws2811_stats_t *stats);       //< Read render statistics
+void ws2811_reset_stats(ws2811_t *ws2811);                             //< Clear render statistics
 const char * ws2811_get_return_t_str(const ws2811_return_t state);     //< Get string representation of the given return state
 
 #ifdef __cplusplus